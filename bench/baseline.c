@@ -0,0 +1,244 @@
+/* The operations of primitives.c implemented with pthreads and ucontext,
+ * to compare the library against the host's kernel threads and user-level contexts.
+ * usage: baseline [iterations [max_threads]]
+ * The process is pinned to one CPU so that pthreads take turns like the library's threads do */
+
+#include "bench.h"
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#define SCALING_ROUNDS 200
+#define UCONTEXT_STACK_SIZE (64 * 1024)
+
+static long iterations;
+
+static const size_t chan_sizes[] = {8, 64, 512, 4096};
+#define NUM_CHAN_SIZES (sizeof(chan_sizes) / sizeof(chan_sizes[0]))
+static char chan_buf[2][4096];
+
+static sem_t ping, pong;
+
+/* A rendezvous channel built from a mutex and condition variable: the sender
+ * waits until the receiver has copied the message, like Chan_send */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    void *ptr;
+    size_t size;
+    int full;
+} chans[2];
+
+static ucontext_t main_ctx, other_ctx;
+
+/* Holds the yielders back until they have all been created, so that creation isn't timed */
+static pthread_barrier_t start_line;
+
+static void chan_send(int c, void *ptr, size_t size) {
+    pthread_mutex_lock(&chans[c].lock);
+    while (chans[c].full) {
+        pthread_cond_wait(&chans[c].changed, &chans[c].lock);
+    }
+    chans[c].ptr = ptr;
+    chans[c].size = size;
+    chans[c].full = 1;
+    pthread_cond_broadcast(&chans[c].changed);
+    while (chans[c].full) {
+        pthread_cond_wait(&chans[c].changed, &chans[c].lock);
+    }
+    pthread_mutex_unlock(&chans[c].lock);
+}
+
+static void chan_receive(int c, void *ptr, size_t size) {
+    pthread_mutex_lock(&chans[c].lock);
+    while (!chans[c].full) {
+        pthread_cond_wait(&chans[c].changed, &chans[c].lock);
+    }
+    memcpy(ptr, chans[c].ptr, size < chans[c].size ? size : chans[c].size);
+    chans[c].full = 0;
+    pthread_cond_broadcast(&chans[c].changed);
+    pthread_mutex_unlock(&chans[c].lock);
+}
+
+static void *yielder(void *args) {
+    long rounds = *(long *)args;
+
+    pthread_barrier_wait(&start_line);
+    for (long i = 0; i < rounds; i++) {
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static void *nothing(void *args) {
+    return args;
+}
+
+static void *sem_ponger(void *args) {
+    (void)args;
+
+    for (long i = 0; i < iterations; i++) {
+        sem_wait(&ping);
+        sem_post(&pong);
+    }
+
+    return NULL;
+}
+
+static void *chan_echo(void *args) {
+    size_t size = *(size_t *)args;
+
+    for (long i = 0; i < iterations; i++) {
+        chan_receive(0, chan_buf[1], size);
+        chan_send(1, chan_buf[1], size);
+    }
+
+    return NULL;
+}
+
+static void swapper(void) {
+    for (;;) {
+        swapcontext(&other_ctx, &main_ctx);
+    }
+}
+
+/* Each round trip is two swapcontext calls, so ops counts switches */
+static void bench_swapcontext(void) {
+    static char stack[UCONTEXT_STACK_SIZE];
+    Bench_T b;
+
+    getcontext(&other_ctx);
+    other_ctx.uc_stack.ss_sp = stack;
+    other_ctx.uc_stack.ss_size = sizeof stack;
+    other_ctx.uc_link = NULL;
+    makecontext(&other_ctx, swapper, 0);
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        swapcontext(&main_ctx, &other_ctx);
+    }
+    bench_stop(&b, "swtch", "ucontext", 0, 2 * iterations);
+}
+
+static void bench_pause(void) {
+    pthread_t threads[2];
+    Bench_T b;
+
+    pthread_barrier_init(&start_line, NULL, 3);
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, yielder, &iterations);
+    }
+    pthread_barrier_wait(&start_line);
+
+    bench_start(&b);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    bench_stop(&b, "pause", "pthread", 2, 2 * iterations);
+    pthread_barrier_destroy(&start_line);
+}
+
+static void bench_create(void) {
+    pthread_t thread;
+    Bench_T b;
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        pthread_create(&thread, NULL, nothing, NULL);
+        pthread_join(thread, NULL);
+    }
+    bench_stop(&b, "create_join", "pthread", 0, iterations);
+}
+
+static void bench_sem(void) {
+    pthread_t thread;
+    Bench_T b;
+
+    sem_init(&ping, 0, 0);
+    sem_init(&pong, 0, 0);
+    pthread_create(&thread, NULL, sem_ponger, NULL);
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        sem_post(&ping);
+        sem_wait(&pong);
+    }
+    bench_stop(&b, "sem_pingpong", "pthread", 0, iterations);
+    pthread_join(thread, NULL);
+}
+
+static void bench_chan(void) {
+    pthread_t thread;
+    Bench_T b;
+
+    for (int c = 0; c < 2; c++) {
+        pthread_mutex_init(&chans[c].lock, NULL);
+        pthread_cond_init(&chans[c].changed, NULL);
+    }
+
+    for (size_t s = 0; s < NUM_CHAN_SIZES; s++) {
+        size_t size = chan_sizes[s];
+
+        pthread_create(&thread, NULL, chan_echo, &size);
+
+        bench_start(&b);
+        for (long i = 0; i < iterations; i++) {
+            chan_send(0, chan_buf[0], size);
+            chan_receive(1, chan_buf[0], size);
+        }
+        bench_stop(&b, "chan_roundtrip", "pthread", (long)size, iterations);
+        pthread_join(thread, NULL);
+    }
+}
+
+static void bench_scaling(int max_threads) {
+    static long rounds = SCALING_ROUNDS;
+    pthread_t *threads = malloc(max_threads * sizeof *threads);
+    Bench_T b;
+
+    for (int n = 2; threads && n <= max_threads; n *= 2) {
+        pthread_barrier_init(&start_line, NULL, n + 1);
+        for (int i = 0; i < n; i++) {
+            if (pthread_create(&threads[i], NULL, yielder, &rounds) != 0) {
+                // The threads already created are left waiting at the barrier, the process ends anyway
+                fprintf(stderr, "scaling: could not create %d threads\n", n);
+                free(threads);
+                return;
+            }
+        }
+        pthread_barrier_wait(&start_line);
+
+        bench_start(&b);
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        bench_stop(&b, "scaling", "pthread", n, (long)n * rounds);
+        pthread_barrier_destroy(&start_line);
+    }
+    free(threads);
+}
+
+int main(int argc, char *argv[]) {
+    cpu_set_t cpus;
+
+    iterations = argc > 1 ? atol(argv[1]) : 100000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 1024;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    sched_setaffinity(0, sizeof cpus, &cpus);
+    cycles_init();
+
+    bench_swapcontext();
+    bench_pause();
+    bench_create();
+    bench_sem();
+    bench_chan();
+    bench_scaling(max_threads);
+
+    return 0;
+}
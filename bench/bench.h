@@ -0,0 +1,47 @@
+#ifndef BENCH_INCLUDED
+#define BENCH_INCLUDED
+
+/* Result reporting shared by the benchmarks, timed with the library's cycle counter.
+ * Every result is printed as one JSON object per line:
+ *   {"bench":"pause","impl":"thread","param":2,"ops":100000,"cycles_per_op":...,"ns_per_op":...}
+ * param is the thread count or message size the benchmark was run with, 0 if it has none.
+ * ns_per_op is -1 where no wall clock is available */
+
+#include "cycles.h"
+#include <stdio.h>
+
+#if ARDUINO_SAM_DUE
+static inline double bench_now_ns(void) {
+    return -1;
+}
+#else
+#include <time.h>
+
+static inline double bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+/* A running measurement. Differences are taken in cycles_t so that a wrapping counter still works */
+typedef struct Bench_T {
+    cycles_t start_cycles;
+    double start_ns;
+} Bench_T;
+
+static inline void bench_start(Bench_T *b) {
+    b->start_ns = bench_now_ns();
+    b->start_cycles = cycles_now();
+}
+
+static inline void bench_stop(Bench_T *b, const char *bench, const char *impl, long param, long ops) {
+    cycles_t cycles = (cycles_t)(cycles_now() - b->start_cycles);
+    double ns = b->start_ns < 0 ? -1 : (bench_now_ns() - b->start_ns) / ops;
+
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"param\":%ld,\"ops\":%ld,\"cycles_per_op\":%.1f,\"ns_per_op\":%.1f}\n",
+           bench, impl, param, ops, (double)cycles / ops, ns);
+}
+
+#endif
@@ -0,0 +1,196 @@
+/* Microbenchmarks of the thread library primitives.
+ * usage: primitives [iterations [max_threads]]
+ * Most are measured with preemption turned off so that the timer doesn't add noise.
+ * pause, sem_pingpong and chan_roundtrip are also measured first with the default
+ * quantum, as applications run, under the impl "thread_preemptive". Results are
+ * printed as JSON lines, see bench.h. The same operations are measured against
+ * pthreads and ucontext by baseline.c */
+
+#include "bench.h"
+#include "chan.h"
+#include "sem.h"
+#include "thread.h"
+#include <stdlib.h>
+
+/* Rounds of Thread_pause per thread in the scaling benchmark */
+#define SCALING_ROUNDS 200
+
+/* Stack size of the threads in the scaling benchmark, small enough to create thousands */
+#define SCALING_STACK_SIZE 2048
+
+extern void _swtch(void *from, void *to);
+
+static long iterations;
+static const char *impl = "thread"; // reported with the results, tells whether preemption was on
+
+static const size_t chan_sizes[] = {8, 64, 512, 4096};
+#define NUM_CHAN_SIZES (sizeof(chan_sizes) / sizeof(chan_sizes[0]))
+static char chan_buf[2][4096];
+
+static Sem_T ping, pong;
+static Chan_T to_echo, from_echo;
+
+static int pauser(void *args, size_t nbytes) {
+    long rounds = *(long *)args;
+
+    (void)nbytes;
+    for (long i = 0; i < rounds; i++) {
+        Thread_pause();
+    }
+
+    return 0;
+}
+
+static int nothing(void *args, size_t nbytes) {
+    (void)args;
+    (void)nbytes;
+
+    return 0;
+}
+
+static int sem_ponger(void *args, size_t nbytes) {
+    (void)args;
+    (void)nbytes;
+
+    for (long i = 0; i < iterations; i++) {
+        Sem_wait(&ping);
+        Sem_signal(&pong);
+    }
+
+    return 0;
+}
+
+static int chan_echo(void *args, size_t nbytes) {
+    size_t size = *(size_t *)args;
+
+    (void)nbytes;
+    for (long i = 0; i < iterations; i++) {
+        Chan_receive(to_echo, chan_buf[1], size);
+        Chan_send(from_echo, chan_buf[1], size);
+    }
+
+    return 0;
+}
+
+/* _swtch from the current stack to itself saves and restores exactly what a real switch does */
+static void bench_swtch(void) {
+    void *sp;
+    Bench_T b;
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        _swtch(&sp, &sp);
+    }
+    bench_stop(&b, "swtch", "thread", 0, iterations);
+}
+
+/* Two threads handing the processor back and forth with Thread_pause */
+static void bench_pause(void) {
+    Bench_T b;
+
+    Thread_new(pauser, &iterations, sizeof iterations);
+    Thread_new(pauser, &iterations, sizeof iterations);
+
+    bench_start(&b);
+    Thread_join(0);
+    bench_stop(&b, "pause", impl, 2, 2 * iterations);
+}
+
+/* Thread_new, then Thread_join until the new thread has run and exited */
+static void bench_create(void) {
+    Bench_T b;
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        Thread_join(Thread_new(nothing, NULL, 0));
+    }
+    bench_stop(&b, "create_join", "thread", 0, iterations);
+}
+
+/* Round trips between this thread and another one through two semaphores */
+static void bench_sem(void) {
+    Bench_T b;
+
+    Sem_init(&ping, 0);
+    Sem_init(&pong, 0);
+    int tid = Thread_new(sem_ponger, NULL, 0);
+
+    bench_start(&b);
+    for (long i = 0; i < iterations; i++) {
+        Sem_signal(&ping);
+        Sem_wait(&pong);
+    }
+    bench_stop(&b, "sem_pingpong", impl, 0, iterations);
+    Thread_join(tid);
+}
+
+/* Round trips of a message of each size through two rendezvous channels */
+static void bench_chan(void) {
+    Bench_T b;
+
+    to_echo = Chan_new();
+    from_echo = Chan_new();
+
+    for (size_t s = 0; s < NUM_CHAN_SIZES; s++) {
+        size_t size = chan_sizes[s];
+        int tid = Thread_new(chan_echo, &size, sizeof size);
+
+        bench_start(&b);
+        for (long i = 0; i < iterations; i++) {
+            Chan_send(to_echo, chan_buf[0], size);
+            Chan_receive(from_echo, chan_buf[0], size);
+        }
+        bench_stop(&b, "chan_roundtrip", impl, (long)size, iterations);
+        Thread_join(tid);
+    }
+}
+
+/* Cost of a Thread_pause switch as the number of threads grows */
+static void bench_scaling(int max_threads) {
+    static long rounds = SCALING_ROUNDS;
+    Thread_attr attr;
+    Bench_T b;
+
+    Thread_attr_init(&attr);
+    attr.stack_size = SCALING_STACK_SIZE;
+
+    for (int n = 2; n <= max_threads; n *= 2) {
+        for (int i = 0; i < n; i++) {
+            if (Thread_new_attr(pauser, &rounds, sizeof rounds, &attr) < 0) {
+                fprintf(stderr, "scaling: could not create %d threads\n", n);
+                Thread_join(0);
+                return;
+            }
+        }
+
+        bench_start(&b);
+        Thread_join(0);
+        bench_stop(&b, "scaling", "thread", n, (long)n * rounds);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    iterations = argc > 1 ? atol(argv[1]) : 100000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 1024;
+
+    cycles_init();
+    Thread_init();
+
+    impl = "thread_preemptive";
+    bench_pause();
+    bench_sem();
+    bench_chan();
+
+    Thread_set_quantum(0);
+    impl = "thread";
+
+    bench_swtch();
+    bench_pause();
+    bench_create();
+    bench_sem();
+    bench_chan();
+    bench_scaling(max_threads);
+
+    Thread_exit(0);
+    return 0;
+}
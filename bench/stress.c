@@ -0,0 +1,131 @@
+/* Stress test of preemption with a very short quantum.
+ * usage: stress [quantum_us [rounds]]
+ * Threads of several priorities sleep, wait with timeouts, select on channels and take a
+ * priority inheritance mutex while the timer ticks every few microseconds, so that ticks
+ * keep landing inside the library and inside the tick handler itself. Handlers that nest
+ * without bound show up as stack use, so the peak is checked against STRESS_STACK_LIMIT.
+ * Build with -DSTACK_WATERMARK=1 (make stress) for the stack use to be measured.
+ * Exits with 1 on failure */
+
+#include "chan.h"
+#include "mutex.h"
+#include "sem.h"
+#include "thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STRESS_THREADS 16
+
+/* Stack of each thread, and the most of it a thread may use */
+#define STRESS_STACK_SIZE (16 * 1024)
+#define STRESS_STACK_LIMIT (12 * 1024)
+
+static long rounds = 2000;
+static Sem_T sem;
+static Mutex_T mutex;
+static Chan_T chans[2];
+static long counter; // incremented under mutex
+static long expected[STRESS_THREADS];
+
+static void spin(int n) {
+    for (volatile int i = 0; i < n; i++) {
+    }
+}
+
+static int worker(void *args, size_t nbytes) {
+    int id = *(int *)args;
+
+    (void)nbytes;
+    for (long r = 0; r < rounds; r++) {
+        switch ((id + r) % 4) {
+        case 0:
+            Thread_sleep_us(30);
+            break;
+        case 1:
+            if (Sem_wait_timeout(&sem, 50)) {
+                Sem_signal(&sem);
+            }
+            break;
+        case 2: {
+            int out = (int)r, in;
+            Chan_case_T cases[] = {
+                {chans[0], CHAN_SEND, &out, sizeof out},
+                {chans[1], CHAN_RECEIVE, &in, sizeof in},
+                {chans[0], CHAN_RECEIVE, &in, sizeof in},
+            };
+            Chan_select(cases, 3, 0);
+            break;
+        }
+        case 3:
+            Mutex_lock(&mutex);
+            counter++;
+            spin(200);
+            Mutex_unlock(&mutex);
+            expected[id]++;
+            break;
+        }
+        spin(500);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int quantum = argc > 1 ? atoi(argv[1]) : 20;
+    static int ids[STRESS_THREADS];
+    Thread_attr attr;
+    int peak = 0;
+
+    if (argc > 2) {
+        rounds = atol(argv[2]);
+    }
+    Thread_init();
+    Sem_init(&sem, 1);
+    Mutex_init(&mutex, MUTEX_PRIORITY_INHERIT);
+    chans[0] = Chan_new_buffered(4, sizeof(int));
+    chans[1] = Chan_new_buffered(4, sizeof(int));
+    Thread_set_quantum(quantum);
+
+    Thread_attr_init(&attr);
+    attr.stack_size = STRESS_STACK_SIZE;
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        ids[i] = i;
+        attr.priority = 14 + i % 4;
+        if (Thread_new_attr(worker, &ids[i], sizeof ids[i], &attr) < 0) {
+            fprintf(stderr, "stress: Thread_new_attr failed\n");
+            return 1;
+        }
+    }
+
+    // Sample the stack use of the workers until only main is left
+    for (;;) {
+        Thread_stats_T stats[STRESS_THREADS + 1];
+        int n = Thread_stats_all(stats, STRESS_THREADS + 1);
+
+        for (int i = 0; i < n; i++) {
+            if (stats[i].stack_used > peak) {
+                peak = stats[i].stack_used;
+            }
+        }
+        if (n <= 1) {
+            break;
+        }
+        Thread_sleep_us(200);
+    }
+    Thread_join(0);
+
+    long total = 0;
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        total += expected[i];
+    }
+    printf("stress: quantum %d us, %ld rounds, peak stack %d bytes, counter %ld\n", quantum,
+           rounds, peak, counter);
+    if (counter != total) {
+        fprintf(stderr, "stress: counter %ld, expected %ld\n", counter, total);
+        return 1;
+    }
+    if (peak > STRESS_STACK_LIMIT) {
+        fprintf(stderr, "stress: peak stack %d over %d\n", peak, STRESS_STACK_LIMIT);
+        return 1;
+    }
+    return 0;
+}
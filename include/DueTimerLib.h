@@ -1,10 +1,15 @@
 #ifndef __DUETIMERLIB_H
 #define __DUETIMERLIB_H
 
+#if ARDUINO_SAM_DUE
 #include "Arduino.h"
+#else
+#include <stdint.h>
+#endif
 
 typedef struct Timer Timer_t;
 
+#if ARDUINO_SAM_DUE
 typedef struct {
     uint32_t R0;
     uint32_t R1;
@@ -15,8 +20,20 @@ typedef struct {
     uint32_t PSR;
     uint32_t LR;
 } Context;
+#elif linux
+/* Filled by the timer's signal handler from the interrupted ucontext */
+typedef struct {
+    uintptr_t return_PC;
+    uintptr_t SP;
+} Context;
+#endif
 
-const Timer_t *get_available_timer();
+Timer_t *get_available_timer();
+/* handler runs every period_us with preempt_count raised by one, so that a tick arriving
+ * meanwhile can't nest inside it */
 void set_timer(Timer_t *timer, int period_us, void (*handler)(Context *));
+void stop_timer(Timer_t *timer);
+void start_timer(Timer_t *timer);
+void wait_for_interrupt(void);
 
-#endif /* __DUETIMERLIB_H */
\ No newline at end of file
+#endif /* __DUETIMERLIB_H */
@@ -7,8 +7,38 @@
 typedef struct T *T;
 
 extern T Chan_new(void);
+/* A channel that queues up to capacity messages of at most elem_size bytes.
+ * Chan_send blocks only while it is full and returns the number of bytes queued */
+extern T Chan_new_buffered(size_t capacity, size_t elem_size);
 extern size_t Chan_send(T c, void *ptr, size_t size);
 extern size_t Chan_receive(T c, void *ptr, size_t size);
 
+/* Pass ownership of a buffer through the channel without copying its contents.
+ * Buffered channels used this way need elem_size >= CHAN_PTR_MSG_SIZE */
+#define CHAN_PTR_MSG_SIZE (sizeof(void *) + sizeof(size_t))
+extern void Chan_send_ptr(T c, void *ptr, size_t size);
+extern void *Chan_receive_ptr(T c, size_t *size);
+
+/* A pool of count preallocated buffers of buf_size bytes. Chan_pool_get blocks
+ * until a buffer is free, Chan_pool_put gives it back for reuse */
+extern T Chan_new_pool(size_t count, size_t buf_size);
+extern void *Chan_pool_get(T pool);
+extern void Chan_pool_put(T pool, void *buf);
+
+/* One of the operations Chan_select waits on. A case with a NULL chan is never ready.
+ * When the case is selected, size is set to the number of bytes transferred */
+typedef struct Chan_case_T {
+    T chan;
+    enum { CHAN_SEND, CHAN_RECEIVE } op;
+    void *ptr;
+    size_t size;
+} Chan_case_T;
+
+/* Perform exactly one of the cases, blocking until one can proceed, and return its index.
+ * If block is 0 and no case is ready, return -1 immediately instead.
+ * A rendezvous case is ready once a thread is blocked on the other end of its channel,
+ * in Chan_send, Chan_receive or a Chan_select of its own */
+extern int Chan_select(Chan_case_T cases[], int ncases, int block);
+
 #undef T
 #endif
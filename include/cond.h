@@ -0,0 +1,25 @@
+#ifndef COND_INCLUDED
+#define COND_INCLUDED
+
+#include "mutex.h"
+#include "queue.h"
+
+#define T Cond_T
+
+typedef struct T { /* opaque! */
+    IQueue_t waiters; /* threads blocked in Cond_wait, first to wake up at the head */
+} T;
+
+extern void Cond_init(T *c);
+/* Unlock m, which the caller must hold, and block until signaled, atomically. m is locked
+ * again when Cond_wait returns. Recheck the condition in a loop, another thread may have
+ * changed it before this one got m back */
+extern void Cond_wait(T *c, Mutex_T *m);
+/* Wake one waiter, if any. It goes straight to the wait queue of its mutex instead of
+ * running only to block on it again */
+extern void Cond_signal(T *c);
+/* Wake all waiters */
+extern void Cond_broadcast(T *c);
+
+#undef T
+#endif
@@ -0,0 +1,22 @@
+#ifndef CYCLES_INCLUDED
+#define CYCLES_INCLUDED
+
+#include <stdint.h>
+
+/* The processor's cycle counter, used by the library for per-thread accounting and tracing.
+ * DWT CYCCNT on the Due, which wraps around every 2^32 cycles (51 s at 84 MHz), and
+ * rdtsc on the host. Differences of cycles_t values are always correct across one wrap */
+
+#if ARDUINO_SAM_DUE
+typedef uint32_t cycles_t;
+#else
+typedef uint64_t cycles_t;
+#endif
+
+/* Start the counter. Called by Thread_init */
+extern void cycles_init(void);
+extern cycles_t cycles_now(void);
+/* Counter frequency. On the host it is measured against the wall clock since cycles_init */
+extern uint32_t cycles_per_ms(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef MUTEX_INCLUDED
+#define MUTEX_INCLUDED
+
+#include "queue.h"
+
+#define T Mutex_T
+
+/* Flags of Mutex_init */
+#define MUTEX_PRIORITY_INHERIT 1 /* lend the priority of blocked threads to the owner */
+
+typedef struct T { /* opaque! */
+    struct Thread *owner; /* NULL while unlocked */
+    int flags;
+    IQueue_t waiters;     /* threads blocked in Mutex_lock, highest priority first */
+    struct T *next_held;  /* next priority inheriting mutex held by the same owner */
+} T;
+
+extern void Mutex_init(T *m, int flags);
+/* Mutexes are not recursive: locking one the calling thread holds is a runtime error */
+extern void Mutex_lock(T *m);
+/* Lock m only if it is free. Returns 1 if it was locked, 0 otherwise */
+extern int Mutex_trylock(T *m);
+/* Only the owner may unlock m. Ownership passes straight to the first waiter, if any */
+extern void Mutex_unlock(T *m);
+
+#undef T
+#endif
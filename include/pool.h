@@ -0,0 +1,16 @@
+#ifndef POOL_INCLUDED
+#define POOL_INCLUDED
+
+#include <stddef.h>
+
+/* Allocator for the library's small, frequently allocated objects: queue nodes, symbol
+ * table bindings and channels. Blocks come in POOL_NUM_CLASSES power of 2 size classes from
+ * POOL_MIN_BLOCK bytes up, carved out of a static arena of POOL_ARENA_SIZE bytes and recycled
+ * through a free list per class, so both calls take constant time. Larger requests, and
+ * those made once the arena is used up, fall back to malloc. Both functions are safe to call
+ * from any thread. Pool_free must be given the size the block was allocated with */
+
+extern void *Pool_alloc(size_t size);
+extern void Pool_free(void *ptr, size_t size);
+
+#endif
@@ -1,6 +1,13 @@
 /* Development : Nikos Boumakis, 4346
  * Email : csd4346 @csd.uoc.gr */
 
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <stddef.h>
+
+/* A FIFO of pointers kept in a power of 2 ring buffer that doubles when full, so that
+ * enqueue and dequeue never allocate once the queue has reached its working size */
 typedef struct Queue *Queue_t;
 
 /* Creates a new, empty queue. Memory the queue will be allocated dynamically */
@@ -16,8 +23,8 @@ void delete_queue(Queue_t queue);
 /* Append elem to the end of the queue */
 void enqueue(Queue_t queue, void *elem);
 
-/* Remove and return the element at the start of the queue. The queue is shortened
- * and memory is freed. Returns NULL if the queue was already empty. */
+/* Remove and return the element at the start of the queue. The queue is shortened.
+ * Returns NULL if the queue was already empty. */
 void *dequeue(Queue_t queue);
 
 /* Return the element at the start of the queue. The queue is unaffected, i.e.
@@ -33,3 +40,44 @@ int queue_isEmpty(Queue_t queue);
 
 /* Extend queue queue dest with the elements from queue src. After this, src is empty */
 void queue_extend(Queue_t src, Queue_t dest);
+
+/* Intrusive FIFO. The link is a field of the queued object, such as a Thread descriptor,
+ * so queueing never allocates. An object can be in one intrusive queue per link field.
+ * The queue is doubly linked so that any link is removed in constant time.
+ * These functions don't disable preemption, the owner of the queue does */
+typedef struct IQueue_link {
+    struct IQueue_link *next;
+    struct IQueue_link *prev;
+} IQueue_link;
+
+typedef struct IQueue_t {
+    IQueue_link *head;
+    IQueue_link *tail;
+} IQueue_t;
+
+/* The object of type type whose member field is link */
+#define IQUEUE_ENTRY(link, type, member) ((type *)((char *)(link) - offsetof(type, member)))
+
+/* Make queue empty */
+void iqueue_init(IQueue_t *queue);
+
+/* Append link to the end of the queue */
+void iqueue_append(IQueue_t *queue, IQueue_link *link);
+
+/* Insert link at the start of the queue, to be the next one removed */
+void iqueue_push(IQueue_t *queue, IQueue_link *link);
+
+/* Insert link right after prev, which is in the queue, or at the start if prev is NULL */
+void iqueue_insert_after(IQueue_t *queue, IQueue_link *prev, IQueue_link *link);
+
+/* Remove and return the link at the start of the queue, or NULL if it is empty */
+IQueue_link *iqueue_pop(IQueue_t *queue);
+
+/* Remove link from the queue. Returns 0 if it wasn't there, 1 otherwise. A link that is in
+ * another queue must not be passed */
+int iqueue_remove(IQueue_t *queue, IQueue_link *link);
+
+/* Return 1 if there is at least one link in the queue, 0 otherwise */
+int iqueue_isEmpty(const IQueue_t *queue);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef RWLOCK_INCLUDED
+#define RWLOCK_INCLUDED
+
+#include "queue.h"
+
+#define T RWLock_T
+
+/* Flags of RWLock_init */
+#define RWLOCK_PREFER_WRITER 1 /* new readers wait behind a waiting writer, so writers can't starve */
+
+typedef struct T { /* opaque! */
+    int readers;           /* threads holding the lock shared */
+    struct Thread *writer; /* thread holding the lock exclusive, NULL if none */
+    int flags;
+    IQueue_t read_waiters;  /* threads blocked in RWLock_rdlock, all let in together */
+    IQueue_t write_waiters; /* threads blocked in RWLock_wrlock, first to get the lock at the head */
+} T;
+
+extern void RWLock_init(T *l, int flags);
+/* Acquire l shared. Any number of readers hold it at once while no writer does */
+extern void RWLock_rdlock(T *l);
+/* Acquire l exclusive, once no other thread holds it */
+extern void RWLock_wrlock(T *l);
+/* Like RWLock_rdlock and RWLock_wrlock, but don't block. Return 1 if l was acquired, 0 otherwise */
+extern int RWLock_tryrdlock(T *l);
+extern int RWLock_trywrlock(T *l);
+/* Release l, held shared or exclusive by the calling thread. The lock passes straight
+ * to the next writer or to all the waiting readers at once */
+extern void RWLock_unlock(T *l);
+
+#undef T
+#endif
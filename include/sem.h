@@ -1,15 +1,21 @@
 #ifndef SEM_INCLUDED
 #define SEM_INCLUDED
 
+#include "queue.h"
+
 #define T Sem_T
 
 typedef struct T { /* opaque! */
     int id;
     int count;
+    IQueue_t waiters; /* threads blocked in Sem_wait, first to wake up at the head */
 } T;
 
 extern void Sem_init(T *s, int count);
 extern void Sem_wait(T *s);
+/* Like Sem_wait, but give up after usecs. A negative usecs waits forever.
+ * Returns 1 if the semaphore was taken, 0 on timeout */
+extern int Sem_wait_timeout(T *s, int usecs);
 extern void Sem_signal(T *s);
 
 #undef T
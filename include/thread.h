@@ -2,12 +2,62 @@
 #define THREAD_INCLUDED
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* Priorities range from THREAD_PRIORITY_MIN to THREAD_PRIORITY_MAX, higher runs first */
+#define THREAD_PRIORITY_MIN 0
+#define THREAD_PRIORITY_MAX 31
+#define THREAD_PRIORITY_DEFAULT 16
+
+/* Creation attributes for Thread_new_attr. Initialize with Thread_attr_init before setting fields */
+typedef struct Thread_attr {
+    int priority;
+    size_t stack_size; /* 0 for the default STACK_SIZE */
+} Thread_attr;
+
+/* What Thread_stats reports about a thread. Times are in microseconds */
+typedef struct Thread_stats_T {
+    int tid;
+    int priority;
+    uint64_t cpu_us;               /* time spent running */
+    uint64_t blocked_us;           /* time spent blocked on semaphores, mutexes, condition variables, locks and joins */
+    uint32_t voluntary_switches;   /* blocked or called Thread_pause */
+    uint32_t involuntary_switches; /* preempted by the timer or by a thread of higher priority */
+    uint32_t preemptions_skipped;  /* timer ticks deferred because preemption was disabled */
+    int stack_used;                /* as returned by Thread_stack_usage */
+} Thread_stats_T;
 
 extern void Thread_init(void);
 extern int Thread_new(int func(void *, size_t), void *args, size_t nbytes, ...);
+extern void Thread_attr_init(Thread_attr *attr);
+extern int Thread_new_attr(int func(void *, size_t), void *args, size_t nbytes, const Thread_attr *attr);
+/* Preallocate count stacks of stack_size bytes (0 for the default) so that Thread_new doesn't
+ * have to allocate them. Returns the number of stacks added to the pool */
+extern int Thread_reserve_stacks(size_t stack_size, int count);
 extern void Thread_exit(int code);
+/* Return the most stack thread tid has ever used, in bytes, or -1 if it doesn't exist, is the
+ * main thread or the library was built without STACK_CHECK and STACK_WATERMARK */
+extern int Thread_stack_usage(int tid);
+/* Store the statistics of thread tid in *out. Returns -1 if tid doesn't exist, 0 otherwise */
+extern int Thread_stats(int tid, Thread_stats_T *out);
+/* Store the statistics of up to max existing threads in out. Returns how many were stored */
+extern int Thread_stats_all(Thread_stats_T *out, int max);
 extern int Thread_self(void);
 extern int Thread_join(int tid);
+/* Like Thread_join, but give up after usecs. A negative usecs waits forever. Returns 1 and
+ * stores the exit code in *code if the thread exited, 0 on timeout and -1 if tid doesn't exist */
+extern int Thread_join_timeout(int tid, int usecs, int *code);
 extern void Thread_pause(void);
+/* Block for at least usecs, rounded up to whole preemption quanta */
+extern void Thread_sleep_us(int usecs);
+/* Set the preemption quantum in microseconds. 0 disables preemption */
+extern void Thread_set_quantum(int usecs);
+/* Change the priority of thread tid. Returns -1 if tid doesn't exist, 0 otherwise */
+extern int Thread_set_priority(int tid, int priority);
+/* Keep the timer from switching threads until the matching Thread_preempt_enable. Calls nest,
+ * and a preemption due meanwhile happens when the outermost one returns. Blocking inside is
+ * allowed, the section resumes disabled */
+extern void Thread_preempt_disable(void);
+extern void Thread_preempt_enable(void);
 
 #endif
@@ -4,7 +4,33 @@
 #include <assert.h>
 #include <stddef.h>
 
-extern int in_libc_flag;
+/* Preemption is disabled while preempt_count is not 0. Library functions and the wrappers
+ * below hold it around everything the timer must not interrupt, and nest freely. A tick that
+ * finds it disabled sets preempt_pending, and the outermost PREEMPT_ENABLE takes the deferred
+ * tick in thread_preempt_point. Thread_preempt_disable and Thread_preempt_enable are the same
+ * for users. A thread that switches out keeps its own count until it runs again.
+ * The timer handler leaves preempt_count as it found it, so a plain increment is safe even
+ * when the tick interrupts it halfway */
+extern volatile int preempt_count;
+extern volatile int preempt_pending;
+
+extern void thread_preempt_point(void);
+
+/* Keep the compiler from moving memory accesses out of a disabled region, even across inlining */
+#define preempt_barrier() __asm__ __volatile__("" ::: "memory")
+
+#define PREEMPT_DISABLE()   \
+    do {                    \
+        ++preempt_count;    \
+        preempt_barrier();  \
+    } while (0)
+
+#define PREEMPT_ENABLE()                                \
+    do {                                                \
+        preempt_barrier();                              \
+        if (--preempt_count == 0 && preempt_pending)    \
+            thread_preempt_point();                     \
+    } while (0)
 
 void threadsafe_free(void *ptr);
 
@@ -25,9 +51,9 @@ void threadsafe_exit(int __status);
 #define calloc threadsafe_calloc
 #define threadsafe_assert(expr) \
     do {                        \
-        in_libc_flag = 1;       \
+        PREEMPT_DISABLE();      \
         assert(expr);           \
-        in_libc_flag = 0;       \
+        PREEMPT_ENABLE();       \
     } while (0)
 
 #define memset threadsafe_memset
@@ -0,0 +1,65 @@
+#ifndef TRACE_INCLUDED
+#define TRACE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Scheduler event tracing, compiled in with -DTHREAD_TRACE. Events go into a ring
+ * buffer of TRACE_SIZE records, the oldest ones being overwritten, and Trace_dump
+ * writes them out in the binary format below. tools/trace2json.c converts a dump
+ * into Chrome trace / Perfetto JSON. Without THREAD_TRACE, TRACE() expands to nothing */
+
+typedef enum {
+    TRACE_SWITCH,       // tid starts running, arg is the tid of the thread switched out
+    TRACE_BLOCK,        // tid blocks, arg is the reason: TRACE_BLOCK_JOIN, _SEM, _SLEEP, _MUTEX, _COND or _RWLOCK
+    TRACE_WAKEUP,       // tid becomes ready, arg is the tid of the thread that woke it, 0 for a timeout
+    TRACE_SEM_WAIT,     // tid calls Sem_wait, arg is the semaphore id
+    TRACE_SEM_SIGNAL,   // tid calls Sem_signal, arg is the semaphore id
+    TRACE_CHAN_SEND,    // tid has sent a message, arg is the channel id
+    TRACE_CHAN_RECEIVE, // tid has received a message, arg is the channel id
+    TRACE_CREATE,       // tid is created, arg is the tid of its creator
+    TRACE_EXIT,         // tid exits, arg is its exit code
+    TRACE_NUM_EVENTS
+} Trace_event;
+
+enum { TRACE_BLOCK_JOIN = 1, TRACE_BLOCK_SEM, TRACE_BLOCK_SLEEP, TRACE_BLOCK_MUTEX, TRACE_BLOCK_COND, TRACE_BLOCK_RWLOCK };
+
+/* One event. cycles is the low 32 bits of the cycle counter and wraps around */
+typedef struct Trace_record {
+    uint32_t cycles;
+    uint8_t type; // a Trace_event
+    uint8_t reserved[3];
+    int32_t tid;
+    uint32_t arg;
+} Trace_record;
+
+/* A dump is this header followed by count records, oldest first */
+#define TRACE_MAGIC "THRTRACE"
+#define TRACE_VERSION 1
+
+typedef struct Trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(Trace_record)
+    uint32_t count;         // number of records that follow
+    uint32_t cycles_per_ms; // frequency of the cycle counter
+} Trace_header;
+
+#if THREAD_TRACE
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 1024 // records in the ring buffer, must be a power of 2
+#endif
+
+extern void Trace_init(void);
+/* Stop or resume recording. Recording starts enabled */
+extern void Trace_enable(int on);
+/* Write the header and the buffered records through write. Recording is paused meanwhile */
+extern void Trace_dump(void write(const void *data, size_t size, void *cl), void *cl);
+extern void trace_record(Trace_event type, int tid, uint32_t arg);
+
+#define TRACE(type, tid, arg) trace_record((type), (tid), (uint32_t)(arg))
+#else
+#define TRACE(type, tid, arg) ((void)0)
+#endif
+
+#endif
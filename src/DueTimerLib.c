@@ -2,6 +2,8 @@
 #include "Arduino.h"
 #include "sam3xa/include/sam3x8e.h"
 #include <assert.h>
+// Included last, only for the preemption counter
+#include "threadsafe_libc.h"
 // Converted to C from ivanseidel's DueTimer library, found at https://github.com/ivanseidel/DueTimer
 
 #ifdef USING_SERVO_LIB
@@ -20,7 +22,7 @@ struct Timer {
     IRQn_Type irq;
 };
 
-static const Timer_t Timers[NUM_TIMERS] = {
+static Timer_t Timers[NUM_TIMERS] = {
     {TC0, 0, TC0_IRQn},
     {TC0, 1, TC1_IRQn},
     {TC0, 2, TC2_IRQn},
@@ -40,7 +42,7 @@ int is_available(IRQn_Type irq) {
     return !(NVIC->ISER[(uint32_t)((int32_t)irq) >> 5] & (uint32_t)(1 << ((uint32_t)((int32_t)irq) & (uint32_t)0x1F)));
 }
 
-const Timer_t *get_available_timer() {
+Timer_t *get_available_timer() {
     for (int i = 0; i < NUM_TIMERS; ++i) {
         if (is_available(Timers[i].irq)) {
             return &Timers[i];
@@ -125,8 +127,36 @@ void set_timer(Timer_t *timer, int period_us, void (*handler)(Context *)) {
     callbacks[timer_index] = handler;
 }
 
+/* Stop the timer's clock. The interrupt stays enabled so the timer remains reserved */
+void stop_timer(Timer_t *timer) {
+    assert(timer);
+
+    TC_Stop(timer->tc, timer->channel);
+}
+
+/* Restart a stopped timer from zero with the period of the last set_timer */
+void start_timer(Timer_t *timer) {
+    assert(timer);
+
+    TC_Start(timer->tc, timer->channel);
+}
+
+/* Sleep until the next interrupt, used when no thread can run until a timeout expires */
+void wait_for_interrupt(void) {
+    __WFI();
+}
+
 extern void (*handler)(Context *);
 
+/* Call the handler of timer index with preemption disabled, as the library expects of a timer
+ * backend. The count is lowered without taking a deferred tick, which would run inside the ISR */
+static void run_callback(int index, Context *ctx) {
+    PREEMPT_DISABLE();
+    callbacks[index](ctx);
+    preempt_barrier();
+    --preempt_count;
+}
+
 #ifndef USING_SERVO_LIB
 void TC0_Handler(void) {
     TC_GetStatus(TC0, 0);
@@ -151,7 +181,7 @@ void TC0_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[0](&ctx);
+    run_callback(0, &ctx);
 }
 #endif
 void TC1_Handler(void) {
@@ -176,7 +206,7 @@ void TC1_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[1](&ctx);
+    run_callback(1, &ctx);
 }
 
 // Fix for compatibility with Servo library
@@ -203,7 +233,7 @@ void TC2_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[2](&ctx);
+    run_callback(2, &ctx);
 }
 void TC3_Handler(void) {
     TC_GetStatus(TC1, 0);
@@ -227,7 +257,7 @@ void TC3_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[3](&ctx);
+    run_callback(3, &ctx);
 }
 void TC4_Handler(void) {
     TC_GetStatus(TC1, 1);
@@ -251,7 +281,7 @@ void TC4_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[4](&ctx);
+    run_callback(4, &ctx);
 }
 void TC5_Handler(void) {
     TC_GetStatus(TC1, 2);
@@ -275,7 +305,7 @@ void TC5_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[5](&ctx);
+    run_callback(5, &ctx);
 }
 #endif
 
@@ -302,7 +332,7 @@ void TC6_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[6](&ctx);
+    run_callback(6, &ctx);
 }
 void TC7_Handler(void) {
     TC_GetStatus(TC2, 1);
@@ -326,7 +356,7 @@ void TC7_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[7](&ctx);
+    run_callback(7, &ctx);
 }
 void TC8_Handler(void) {
     TC_GetStatus(TC2, 2);
@@ -350,6 +380,6 @@ void TC8_Handler(void) {
           "=r"(ctx.PSR),
           "=r"(ctx.LR)::"memory");
 
-    callbacks[8](&ctx);
+    run_callback(8, &ctx);
 }
 #endif
@@ -0,0 +1,123 @@
+#if linux
+#include "DueTimerLib.h"
+#include "threadsafe_libc.h"
+#include <signal.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+// Host implementation of the DueTimerLib interface using setitimer and SIGALRM
+
+struct Timer {
+    int which;               // setitimer timer
+    int signo;               // signal it raises
+    struct itimerval period; // period of the last set_timer, used by start_timer
+};
+
+static Timer_t Timers[] = {
+    {ITIMER_REAL, SIGALRM, {{0, 0}, {0, 0}}},
+};
+
+#define NUM_TIMERS (sizeof(Timers) / sizeof(Timers[0]))
+
+static void (*callbacks[NUM_TIMERS])(Context *);
+
+/* Block or unblock signo. Called with preemption disabled by signal_handler */
+static void mask_signal(int how, int signo) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    sigprocmask(how, &set, NULL);
+}
+
+static void signal_handler(int signo, siginfo_t *info, void *uctx) {
+    ucontext_t *uc = uctx;
+    Context ctx;
+
+    (void)info;
+
+#if __x86_64__
+    ctx.return_PC = uc->uc_mcontext.gregs[REG_RIP];
+    ctx.SP = uc->uc_mcontext.gregs[REG_RSP];
+#else
+    ctx.return_PC = uc->uc_mcontext.gregs[REG_EIP];
+    ctx.SP = uc->uc_mcontext.gregs[REG_ESP];
+#endif
+
+    /* The signal is blocked on entry. It is unblocked for a callback that may switch to
+     * another thread without returning, and blocked again before returning so that it cannot
+     * land in the libc sigreturn trampoline while the interrupted context is still being restored.
+     * sigreturn puts back the mask of the interrupted context.
+     * Preemption stays disabled from before the unblock until after the block, so a tick that
+     * comes while the signal is unblocked here only leaves itself pending instead of running
+     * the callback again on this frame. The callback counts that one level as its own. A thread
+     * it switches to runs with its own count, restored by the switch.
+     * A tick that interrupted a disabled region can't switch, so the signal stays blocked for it.
+     * Unblocking it there would let a short quantum stack up handlers faster than they return */
+    PREEMPT_DISABLE();
+    int may_switch = preempt_count == 1;
+
+    if (may_switch) {
+        mask_signal(SIG_UNBLOCK, signo);
+    }
+    for (size_t i = 0; i < NUM_TIMERS; ++i) {
+        if (Timers[i].signo == signo && callbacks[i]) {
+            callbacks[i](&ctx);
+        }
+    }
+    if (may_switch) {
+        mask_signal(SIG_BLOCK, signo);
+    }
+    preempt_barrier();
+    --preempt_count;
+}
+
+Timer_t *get_available_timer() {
+    for (size_t i = 0; i < NUM_TIMERS; ++i) {
+        if (!callbacks[i]) {
+            return &Timers[i];
+        }
+    }
+
+    return NULL;
+}
+
+void set_timer(Timer_t *timer, int period_us, void (*handler)(Context *)) {
+    struct sigaction sa;
+    size_t index = timer - Timers;
+
+    callbacks[index] = handler;
+
+    // signal_handler unblocks the signal itself while the callback runs
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    PREEMPT_DISABLE();
+    sigaction(timer->signo, &sa, NULL);
+    PREEMPT_ENABLE();
+
+    timer->period.it_interval.tv_sec = period_us / 1000000;
+    timer->period.it_interval.tv_usec = period_us % 1000000;
+    timer->period.it_value = timer->period.it_interval;
+    start_timer(timer);
+}
+
+void stop_timer(Timer_t *timer) {
+    struct itimerval disarm = {{0, 0}, {0, 0}};
+
+    PREEMPT_DISABLE();
+    setitimer(timer->which, &disarm, NULL);
+    PREEMPT_ENABLE();
+}
+
+void start_timer(Timer_t *timer) {
+    PREEMPT_DISABLE();
+    setitimer(timer->which, &timer->period, NULL);
+    PREEMPT_ENABLE();
+}
+
+void wait_for_interrupt(void) {
+    pause();
+}
+#endif
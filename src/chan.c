@@ -1,18 +1,67 @@
 #include "chan.h"
+#include "pool.h"
 #include "sem.h"
+#include "thread.h"
 #include "threadsafe_libc.h"
+#include "trace.h"
 
 #define T Chan_T
+
+/* A thread blocked in Chan_select. It is woken up at most once per wait */
+struct selector {
+    Sem_T wake;
+    int fired;
+    Chan_case_T *cases; /* the cases it waits on */
+    int chosen;         /* case completed for it by another selector, -1 if none */
+};
+
+/* Links a selector into the list of one of the channels it waits on */
+struct sel_waiter {
+    struct selector *sel;
+    int index; /* of the case on this channel */
+    struct sel_waiter *prev, *next;
+};
+
 struct T {                 /* channels: */
     void *ptr;             /* message address */
     size_t *size;          /* pointer to the message size */
     Sem_T send, rec, sync; /* associated semaphores */
+
+    /* buffered channels only, capacity is 0 for rendezvous channels.
+     * send counts the free slots and rec the queued messages */
+    size_t capacity;  /* number of slots in the ring buffer */
+    size_t elem_size; /* bytes per slot */
+    size_t head;      /* next slot to receive from */
+    size_t tail;      /* next slot to send to */
+    size_t *lengths;  /* message size stored in each slot */
+    char *buffer;     /* capacity * elem_size bytes of message data */
+
+    struct sel_waiter *selectors; /* threads in Chan_select waiting for this channel */
 };
 
+/* Wake every selector waiting on c, each at most once. They re-check their cases themselves.
+ * The list lives on the selectors' stacks, so the walk must not switch threads: callers have
+ * preemption disabled, which makes Sem_signal leave the switch to their PREEMPT_ENABLE */
+static void notify_selectors(T c) {
+    for (struct sel_waiter *w = c->selectors; w; w = w->next) {
+        if (!w->sel->fired) {
+            w->sel->fired = 1;
+            Sem_signal(&w->sel->wake);
+        }
+    }
+}
+
+/* Size of the block holding a channel. The descriptor, the slot sizes and the slots
+ * themselves live in one block */
+static size_t chan_bytes(size_t capacity, size_t elem_size) {
+    return sizeof(struct T) + capacity * (sizeof(size_t) + elem_size);
+}
+
 T Chan_new(void) {
-    T c = calloc(1, sizeof *c);
+    T c = Pool_alloc(chan_bytes(0, 0));
 
     if (c) {
+        memset(c, 0, sizeof *c);
         Sem_init(&c->send, 1);
         Sem_init(&c->rec, 0);
         Sem_init(&c->sync, 0);
@@ -20,31 +69,283 @@ T Chan_new(void) {
     return c;
 }
 
-size_t Chan_send(Chan_T c, void *ptr, size_t size) {
-    threadsafe_assert(c);
-    threadsafe_assert(ptr);
+T Chan_new_buffered(size_t capacity, size_t elem_size) {
+    if (capacity == 0)
+        return Chan_new();
+
+    T c = Pool_alloc(chan_bytes(capacity, elem_size));
+
+    if (c) {
+        memset(c, 0, chan_bytes(capacity, elem_size));
+        c->capacity = capacity;
+        c->elem_size = elem_size;
+        c->lengths = (size_t *)(c + 1);
+        c->buffer = (char *)(c->lengths + capacity);
+        Sem_init(&c->send, capacity);
+        Sem_init(&c->rec, 0);
+        Sem_init(&c->sync, 0);
+    }
+    return c;
+}
+
+/* Copy a message into the next free slot, blocking only while the buffer is full */
+static size_t buffered_send(T c, void *ptr, size_t size) {
+    size_t n = size < c->elem_size ? size : c->elem_size;
+
     Sem_wait(&c->send);
-    c->ptr = ptr;
-    c->size = &size;
+    if (n > 0)
+        memcpy(c->buffer + c->tail * c->elem_size, ptr, n);
+    c->lengths[c->tail] = n;
+    c->tail = (c->tail + 1) % c->capacity;
     Sem_signal(&c->rec);
-    Sem_wait(&c->sync);
-    return size;
+    if (c->selectors)
+        notify_selectors(c);
+    TRACE(TRACE_CHAN_SEND, Thread_self(), c->send.id);
+    return n;
 }
 
-size_t Chan_receive(Chan_T c, void *ptr, size_t size) {
+/* Copy the oldest message out of the buffer, blocking only while it is empty */
+static size_t buffered_receive(T c, void *ptr, size_t size) {
     size_t n;
-    long *src;
 
-    threadsafe_assert(c);
-    threadsafe_assert(ptr);
     Sem_wait(&c->rec);
-    n = *c->size;
+    n = c->lengths[c->head];
     if (size < n)
         n = size;
-    *c->size = n;
     if (n > 0)
-        memcpy(ptr, c->ptr, n);
-    Sem_signal(&c->sync);
+        memcpy(ptr, c->buffer + c->head * c->elem_size, n);
+    c->head = (c->head + 1) % c->capacity;
     Sem_signal(&c->send);
+    if (c->selectors)
+        notify_selectors(c);
+    TRACE(TRACE_CHAN_RECEIVE, Thread_self(), c->send.id);
+    return n;
+}
+
+size_t Chan_send(Chan_T c, void *ptr, size_t size) {
+    threadsafe_assert(c);
+    threadsafe_assert(ptr);
+    PREEMPT_DISABLE();
+    if (c->capacity) {
+        size = buffered_send(c, ptr, size);
+    } else {
+        Sem_wait(&c->send);
+        c->ptr = ptr;
+        c->size = &size;
+        Sem_signal(&c->rec);
+        if (c->selectors)
+            notify_selectors(c);
+        Sem_wait(&c->sync);
+        TRACE(TRACE_CHAN_SEND, Thread_self(), c->send.id);
+    }
+    PREEMPT_ENABLE();
+    return size;
+}
+
+size_t Chan_receive(Chan_T c, void *ptr, size_t size) {
+    size_t n;
+
+    threadsafe_assert(c);
+    threadsafe_assert(ptr);
+    PREEMPT_DISABLE();
+    if (c->capacity) {
+        n = buffered_receive(c, ptr, size);
+    } else {
+        /* A receiver about to block makes the channel ready for a selecting sender */
+        if (c->selectors && c->rec.count == 0)
+            notify_selectors(c);
+        Sem_wait(&c->rec);
+        n = *c->size;
+        if (size < n)
+            n = size;
+        *c->size = n;
+        if (n > 0)
+            memcpy(ptr, c->ptr, n);
+        Sem_signal(&c->sync);
+        Sem_signal(&c->send);
+        if (c->selectors)
+            notify_selectors(c);
+        TRACE(TRACE_CHAN_RECEIVE, Thread_self(), c->send.id);
+    }
+    PREEMPT_ENABLE();
     return n;
 }
+
+/* What Chan_send_ptr actually sends: the buffer's address and length, never its contents */
+struct ptr_msg {
+    void *ptr;
+    size_t size;
+};
+
+void Chan_send_ptr(Chan_T c, void *ptr, size_t size) {
+    struct ptr_msg m = {ptr, size};
+
+    threadsafe_assert(c);
+    threadsafe_assert(!c->capacity || c->elem_size >= sizeof m);
+    Chan_send(c, &m, sizeof m);
+}
+
+void *Chan_receive_ptr(Chan_T c, size_t *size) {
+    struct ptr_msg m;
+    size_t n;
+
+    threadsafe_assert(c);
+    n = Chan_receive(c, &m, sizeof m);
+    threadsafe_assert(n == sizeof m && "Chan_receive_ptr needs a message from Chan_send_ptr");
+    if (size)
+        *size = m.size;
+    return m.ptr;
+}
+
+T Chan_new_pool(size_t count, size_t buf_size) {
+    T pool = Chan_new_buffered(count, CHAN_PTR_MSG_SIZE);
+    char *bufs = malloc(count * buf_size);
+
+    if (!pool || !bufs) {
+        Pool_free(pool, chan_bytes(count, CHAN_PTR_MSG_SIZE));
+        free(bufs);
+        return NULL;
+    }
+
+    /* Nobody can be blocked on a new channel, so filling it never waits */
+    for (size_t i = 0; i < count; i++)
+        Chan_send_ptr(pool, bufs + i * buf_size, buf_size);
+    return pool;
+}
+
+void *Chan_pool_get(Chan_T pool) {
+    return Chan_receive_ptr(pool, NULL);
+}
+
+void Chan_pool_put(Chan_T pool, void *buf) {
+    Chan_send_ptr(pool, buf, 0);
+}
+
+/* Return 1 if the operation of cs can proceed without waiting for another thread */
+static int case_ready(Chan_case_T *cs) {
+    T c = cs->chan;
+
+    if (!c)
+        return 0;
+    if (cs->op == CHAN_RECEIVE)
+        return c->rec.count > 0;
+    if (c->capacity)
+        return c->send.count > 0;
+    /* A rendezvous send can go ahead once a receiver is blocked waiting for it */
+    return !iqueue_isEmpty(&c->rec.waiters) && c->send.count > 0;
+}
+
+/* Complete the rendezvous case cs with a thread blocked in Chan_select on the other end of
+ * its channel, copying the message between their cases directly. Neither end ever blocks in
+ * Chan_send or Chan_receive for the other, so case_ready can't see them. Returns 1 if a
+ * partner was found */
+static int select_match(Chan_case_T *cs) {
+    T c = cs->chan;
+
+    if (!c || c->capacity)
+        return 0;
+    for (struct sel_waiter *w = c->selectors; w; w = w->next) {
+        Chan_case_T *peer = &w->sel->cases[w->index];
+
+        if (w->sel->fired || peer->op == cs->op)
+            continue;
+
+        Chan_case_T *from = cs->op == CHAN_SEND ? cs : peer;
+        Chan_case_T *to = cs->op == CHAN_SEND ? peer : cs;
+        size_t n = from->size < to->size ? from->size : to->size;
+
+        if (n > 0)
+            memcpy(to->ptr, from->ptr, n);
+        from->size = to->size = n;
+
+        /* Nothing else may wake the partner now, its wait ends with this case */
+        w->sel->fired = 1;
+        w->sel->chosen = w->index;
+        Sem_signal(&w->sel->wake);
+        TRACE(cs->op == CHAN_SEND ? TRACE_CHAN_SEND : TRACE_CHAN_RECEIVE, Thread_self(), c->send.id);
+        return 1;
+    }
+    return 0;
+}
+
+int Chan_select(Chan_case_T cases[], int ncases, int block) {
+    static unsigned rotate = 0;
+    struct selector sel;
+
+    threadsafe_assert(cases && ncases > 0);
+    PREEMPT_DISABLE();
+
+    for (;;) {
+        /* Start from a different case every time so that no channel is starved */
+        int start = (int)(rotate++ % (unsigned)ncases);
+
+        for (int k = 0; k < ncases; k++) {
+            int i = (start + k) % ncases;
+
+            if (case_ready(&cases[i])) {
+                if (cases[i].op == CHAN_RECEIVE)
+                    cases[i].size = Chan_receive(cases[i].chan, cases[i].ptr, cases[i].size);
+                else
+                    cases[i].size = Chan_send(cases[i].chan, cases[i].ptr, cases[i].size);
+                PREEMPT_ENABLE();
+                return i;
+            }
+            if (select_match(&cases[i])) {
+                PREEMPT_ENABLE();
+                return i;
+            }
+        }
+
+        if (!block) {
+            PREEMPT_ENABLE();
+            return -1;
+        }
+
+        /* Wait on all channels at once and try again after the first one becomes ready */
+        struct sel_waiter waiters[ncases];
+
+        sel.fired = 0;
+        sel.cases = cases;
+        sel.chosen = -1;
+        /* Private to this call, so it doesn't take an id from Sem_init */
+        sel.wake.id = 0;
+        sel.wake.count = 0;
+        iqueue_init(&sel.wake.waiters);
+
+        for (int i = 0; i < ncases; i++) {
+            T c = cases[i].chan;
+
+            waiters[i].sel = &sel;
+            waiters[i].index = i;
+            waiters[i].prev = NULL;
+            waiters[i].next = c ? c->selectors : NULL;
+            if (c) {
+                if (c->selectors)
+                    c->selectors->prev = &waiters[i];
+                c->selectors = &waiters[i];
+            }
+        }
+
+        Sem_wait(&sel.wake);
+
+        for (int i = 0; i < ncases; i++) {
+            T c = cases[i].chan;
+
+            if (!c)
+                continue;
+            if (waiters[i].prev)
+                waiters[i].prev->next = waiters[i].next;
+            else
+                c->selectors = waiters[i].next;
+            if (waiters[i].next)
+                waiters[i].next->prev = waiters[i].prev;
+        }
+
+        if (sel.chosen >= 0) {
+            TRACE(cases[sel.chosen].op == CHAN_SEND ? TRACE_CHAN_SEND : TRACE_CHAN_RECEIVE, Thread_self(),
+                  cases[sel.chosen].chan->send.id);
+            PREEMPT_ENABLE();
+            return sel.chosen;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#include "cycles.h"
+#include "threadsafe_libc.h"
+
+#if ARDUINO_SAM_DUE
+#include <Arduino.h>
+
+#define DEMCR (*(volatile uint32_t *)0xE000EDFC)
+#define DWT_CTRL (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+void cycles_init(void) {
+    DEMCR |= 1u << 24; // TRCENA
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1u; // CYCCNTENA
+}
+
+cycles_t cycles_now(void) {
+    return DWT_CYCCNT;
+}
+
+uint32_t cycles_per_ms(void) {
+    return SystemCoreClock / 1000;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <time.h>
+#include <x86intrin.h>
+
+// rdtsc runs at a fixed rate that has to be measured against the wall clock
+static cycles_t start_cycles;
+static struct timespec start_time;
+
+void cycles_init(void) {
+    PREEMPT_DISABLE();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    PREEMPT_ENABLE();
+    start_cycles = cycles_now();
+}
+
+cycles_t cycles_now(void) {
+    return __rdtsc();
+}
+
+uint32_t cycles_per_ms(void) {
+    struct timespec now;
+
+    PREEMPT_DISABLE();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    PREEMPT_ENABLE();
+
+    cycles_t cycles = cycles_now();
+    double ms = (now.tv_sec - start_time.tv_sec) * 1e3 + (now.tv_nsec - start_time.tv_nsec) / 1e6;
+
+    return ms > 0 ? (uint32_t)((cycles - start_cycles) / ms) : 0;
+}
+#else
+Unsupported platform
+#endif
@@ -0,0 +1,90 @@
+#include "pool.h"
+#include "threadsafe_libc.h"
+#include <stdint.h>
+
+/* Bytes of static storage the blocks are carved from */
+#ifndef POOL_ARENA_SIZE
+#define POOL_ARENA_SIZE 4096
+#endif
+
+/* Block sizes are POOL_MIN_BLOCK << class. POOL_MIN_BLOCK must be a power of 2 that keeps
+ * blocks aligned for any of the objects stored in them */
+#ifndef POOL_MIN_BLOCK
+#define POOL_MIN_BLOCK 16
+#endif
+#ifndef POOL_NUM_CLASSES
+#define POOL_NUM_CLASSES 5
+#endif
+
+#define POOL_MAX_BLOCK ((size_t)POOL_MIN_BLOCK << (POOL_NUM_CLASSES - 1))
+
+static union {
+    void *p;
+    long long ll;
+    double d;
+    char bytes[POOL_ARENA_SIZE];
+} arena;
+
+static size_t arena_used; // bytes of the arena handed out to the size classes so far
+
+/* Free blocks of each class, linked through their first word */
+static void *free_blocks[POOL_NUM_CLASSES];
+
+/* Return the smallest class whose blocks hold size bytes, or -1 if the block would be too large */
+static int block_class(size_t size) {
+    int c = 0;
+
+    if (size > POOL_MAX_BLOCK) {
+        return -1;
+    }
+    while (((size_t)POOL_MIN_BLOCK << c) < size) {
+        c++;
+    }
+
+    return c;
+}
+
+static int in_arena(void *ptr) {
+    return (char *)ptr >= arena.bytes && (char *)ptr < arena.bytes + POOL_ARENA_SIZE;
+}
+
+void *Pool_alloc(size_t size) {
+    int c = block_class(size);
+    void *block = NULL;
+
+    if (c < 0) {
+        return malloc(size);
+    }
+
+    PREEMPT_DISABLE();
+    if (free_blocks[c]) {
+        block = free_blocks[c];
+        free_blocks[c] = *(void **)block;
+    } else if (POOL_ARENA_SIZE - arena_used >= (size_t)POOL_MIN_BLOCK << c) {
+        // Blocks of every class are multiples of the smallest one, so the arena stays aligned
+        block = arena.bytes + arena_used;
+        arena_used += (size_t)POOL_MIN_BLOCK << c;
+    }
+    PREEMPT_ENABLE();
+
+    return block ? block : malloc(size);
+}
+
+void Pool_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (!in_arena(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    int c = block_class(size);
+
+    threadsafe_assert(c >= 0 && "Runtime error: Pool_free given a different size than Pool_alloc");
+
+    PREEMPT_DISABLE();
+    *(void **)ptr = free_blocks[c];
+    free_blocks[c] = ptr;
+    PREEMPT_ENABLE();
+}
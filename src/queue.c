@@ -2,57 +2,49 @@
  * Email : csd4346 @csd.uoc.gr */
 
 #include "queue.h"
+#include "pool.h"
 #include "threadsafe_libc.h"
 
-#define MAX_FREE_LIST 16
-
-struct Queue_node {
-    void *elem;
-    struct Queue_node *next;
-};
+/* Slots of a new queue. Must be a power of 2 */
+#define QUEUE_MIN_CAPACITY 8
 
 struct Queue {
-    struct Queue_node *head;
-    struct Queue_node *tail;
-
-    struct Queue_node *free_list;
-    int free_list_size;
-
-    int count;
+    void **elems;      // ring buffer of capacity slots
+    unsigned capacity; // a power of 2
+    unsigned head;     // slot of the first element
+    unsigned count;
 };
 
-static struct Queue_node *get_new_node(Queue_t queue) {
-    if (queue->free_list) {
-        struct Queue_node *node = queue->free_list;
-        queue->free_list = queue->free_list->next;
-        --queue->free_list_size;
+/* Double the ring of queue, moving its elements to the start of the new one.
+ * Returns 0 if memory ran out */
+static int grow(Queue_t queue) {
+    unsigned capacity = queue->capacity * 2;
+    void **elems = Pool_alloc(capacity * sizeof(void *));
 
-        return node;
-    } else {
-        return malloc(sizeof(struct Queue_node));
+    if (!elems) {
+        return 0;
     }
-}
 
-static void free_node(Queue_t queue, struct Queue_node *node) {
-    if (queue->free_list_size < MAX_FREE_LIST) {
-        node->next = queue->free_list;
-        queue->free_list = node;
-
-        ++queue->free_list_size;
-    } else {
-        free(node);
+    for (unsigned i = 0; i < queue->count; i++) {
+        elems[i] = queue->elems[(queue->head + i) & (queue->capacity - 1)];
     }
+    Pool_free(queue->elems, queue->capacity * sizeof(void *));
+
+    queue->elems = elems;
+    queue->capacity = capacity;
+    queue->head = 0;
+
+    return 1;
 }
 
 /* Creates a new, empty queue. Memory the queue will be allocated dynamically */
 Queue_t new_queue() {
-    Queue_t queue = malloc(sizeof(struct Queue));
+    Queue_t queue = Pool_alloc(sizeof(struct Queue));
+    queue->elems = Pool_alloc(QUEUE_MIN_CAPACITY * sizeof(void *));
+    threadsafe_assert(queue->elems && "Ran out of memory while trying to allocate a new queue");
+    queue->capacity = QUEUE_MIN_CAPACITY;
+    queue->head = 0;
     queue->count = 0;
-    queue->head = NULL;
-    queue->tail = NULL;
-
-    queue->free_list = NULL;
-    queue->free_list_size = 0;
 
     return queue;
 }
@@ -63,56 +55,35 @@ Queue_t new_queue() {
  * allocated, the queue is empty or the pointers to dynamically allocated elements
  * are held elseware too. */
 void delete_queue(Queue_t queue) {
-    while (queue->count) {
-        dequeue(queue);
-    }
-
-    while (queue->free_list) {
-        struct Queue_node *head = queue->free_list;
-        queue->free_list = queue->free_list->next;
-        free(head);
-    }
-
-    free(queue);
+    Pool_free(queue->elems, queue->capacity * sizeof(void *));
+    Pool_free(queue, sizeof(struct Queue));
 }
 
 /* Append elem to the end of the queue */
 void enqueue(Queue_t queue, void *elem) {
-    struct Queue_node *node = get_new_node(queue);
-    node->elem = elem;
-
-    node->next = NULL;
-    queue->count++;
-
-    if (queue->head == NULL) {
-        queue->head = node;
-        queue->tail = node;
-
-        return;
+    PREEMPT_DISABLE();
+    if (queue->count == queue->capacity) {
+        int grown = grow(queue);
+        threadsafe_assert(grown && "Ran out of memory while trying to grow a queue");
     }
 
-    queue->tail->next = node;
-    queue->tail = node;
+    queue->elems[(queue->head + queue->count) & (queue->capacity - 1)] = elem;
+    queue->count++;
+    PREEMPT_ENABLE();
 }
 
-/* Remove and return the element at the start of the queue. The queue is shortened
- * and memory might be freed. Returns NULL if the queue was already empty. */
+/* Remove and return the element at the start of the queue. The queue is shortened.
+ * Returns NULL if the queue was already empty. */
 void *dequeue(Queue_t queue) {
-    struct Queue_node *tmp = queue->head;
-    void *elem;
-    if (tmp == NULL) {
-        return NULL;
-    }
-
-    queue->head = queue->head->next;
+    void *elem = NULL;
 
-    if (queue->head == NULL) {
-        queue->tail = NULL;
+    PREEMPT_DISABLE();
+    if (queue->count) {
+        elem = queue->elems[queue->head];
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        queue->count--;
     }
-
-    elem = tmp->elem;
-    free_node(queue, tmp);
-    queue->count--;
+    PREEMPT_ENABLE();
 
     return elem;
 }
@@ -121,11 +92,11 @@ void *dequeue(Queue_t queue) {
  * multiple consecutive calls will always return the same element. If the queue is
  * empty, NULL will be returned. */
 void *queue_head(Queue_t queue) {
-    if (queue->head == NULL) {
+    if (queue->count == 0) {
         return NULL;
     }
 
-    return queue->head->elem;
+    return queue->elems[queue->head];
 }
 
 /* Return the number of elements in the queue, or zero if the queue is empty */
@@ -139,16 +110,98 @@ void queue_extend(Queue_t src, Queue_t dest) {
     if (queue_isEmpty(src))
         return;
 
-    if (queue_isEmpty(dest)) {
-        dest->head = src->head;
-        dest->tail = src->tail;
-    } else {
-        dest->tail->next = src->head;
-        dest->tail = src->tail;
+    PREEMPT_DISABLE();
+    while (dest->count + src->count > dest->capacity) {
+        int grown = grow(dest);
+        threadsafe_assert(grown && "Ran out of memory while trying to grow a queue");
     }
 
+    for (unsigned i = 0; i < src->count; i++) {
+        dest->elems[(dest->head + dest->count + i) & (dest->capacity - 1)] =
+            src->elems[(src->head + i) & (src->capacity - 1)];
+    }
     dest->count += src->count;
 
     src->count = 0;
-    src->head = src->tail = NULL;
-}
\ No newline at end of file
+    src->head = 0;
+    PREEMPT_ENABLE();
+}
+
+void iqueue_init(IQueue_t *queue) {
+    queue->head = queue->tail = NULL;
+}
+
+void iqueue_append(IQueue_t *queue, IQueue_link *link) {
+    link->next = NULL;
+    link->prev = queue->tail;
+
+    if (queue->tail) {
+        queue->tail->next = link;
+    } else {
+        queue->head = link;
+    }
+    queue->tail = link;
+}
+
+void iqueue_push(IQueue_t *queue, IQueue_link *link) {
+    link->next = queue->head;
+    link->prev = NULL;
+
+    if (queue->head) {
+        queue->head->prev = link;
+    } else {
+        queue->tail = link;
+    }
+    queue->head = link;
+}
+
+void iqueue_insert_after(IQueue_t *queue, IQueue_link *prev, IQueue_link *link) {
+    if (!prev) {
+        iqueue_push(queue, link);
+        return;
+    }
+
+    link->next = prev->next;
+    link->prev = prev;
+    if (prev->next) {
+        prev->next->prev = link;
+    } else {
+        queue->tail = link;
+    }
+    prev->next = link;
+}
+
+IQueue_link *iqueue_pop(IQueue_t *queue) {
+    IQueue_link *link = queue->head;
+
+    if (link) {
+        iqueue_remove(queue, link);
+    }
+
+    return link;
+}
+
+int iqueue_remove(IQueue_t *queue, IQueue_link *link) {
+    // A link is in the queue if its neighbours point back at it, or if it is the head
+    if (link->prev ? link->prev->next != link : queue->head != link) {
+        return 0;
+    }
+
+    if (link->prev) {
+        link->prev->next = link->next;
+    } else {
+        queue->head = link->next;
+    }
+    if (link->next) {
+        link->next->prev = link->prev;
+    } else {
+        queue->tail = link->prev;
+    }
+    link->next = link->prev = NULL;
+
+    return 1;
+}
+
+int iqueue_isEmpty(const IQueue_t *queue) {
+    return queue->head == NULL;
+}
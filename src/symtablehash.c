@@ -1,32 +1,97 @@
 #include "symtable.h"
+#include "pool.h"
 #include "threadsafe_libc.h"
 #include <stddef.h>
 #include <stdio.h>
 
-#define HASHTABLE_SIZE 16
+/* Slots of a new symbol table. Must be a power of 2 */
+#ifndef SYMTABLE_INITIAL_CAPACITY
+#define SYMTABLE_INITIAL_CAPACITY 16
+#endif
+
+/* The table doubles when an insertion would fill more than
+ * SYMTABLE_MAX_LOAD_NUM / SYMTABLE_MAX_LOAD_DEN of its slots */
+#define SYMTABLE_MAX_LOAD_NUM 3
+#define SYMTABLE_MAX_LOAD_DEN 4
 
 struct SymTable_bind {
     int pcKey;
+    int used; /* 0 for an empty slot */
     void *value;
-
-    struct SymTable_bind *next;
 };
 
+/* Open addressing with linear probing. A binding sits at the first free slot at or
+ * after the slot its key hashes to, with no empty slot in between. Removal shifts the
+ * bindings after it back instead of leaving tombstones, so that stays true */
 struct SymTable {
     unsigned int length;
+    unsigned int capacity; /* a power of 2 */
 
-    struct SymTable_bind *table[HASHTABLE_SIZE];
+    struct SymTable_bind *slots;
 };
 
-/* Return a hash code for pcKey. */
+/* Return a hash code for pcKey. Mixes all the bits of the key into the low ones,
+ * which select the slot, so that sequential and strided keys spread out */
 static unsigned int SymTable_hash(const int pcKey) {
-    return pcKey % HASHTABLE_SIZE;
+    unsigned int h = (unsigned int)pcKey;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/* Return the slot holding pcKey, or the empty slot where it would be inserted */
+static unsigned int SymTable_find(SymTable_T oSymTable, const int pcKey) {
+    unsigned int mask = oSymTable->capacity - 1;
+    unsigned int i = SymTable_hash(pcKey) & mask;
+
+    while (oSymTable->slots[i].used && oSymTable->slots[i].pcKey != pcKey) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/* Allocate capacity empty slots, exiting if memory ran out */
+static struct SymTable_bind *SymTable_slots(unsigned int capacity) {
+    struct SymTable_bind *slots = Pool_alloc(capacity * sizeof(struct SymTable_bind));
+
+    /* Check allocated memory */
+    if (slots == NULL) {
+        printf("Ran out of memory while trying to allocate SymTable bindings!\n"
+               "Exiting now...");
+        exit(-1);
+    }
+    memset(slots, 0, capacity * sizeof(struct SymTable_bind));
+
+    return slots;
+}
+
+/* Double the number of slots of oSymTable and rehash its bindings into them */
+static void SymTable_grow(SymTable_T oSymTable) {
+    struct SymTable_bind *old = oSymTable->slots;
+    unsigned int old_capacity = oSymTable->capacity;
+    unsigned int i;
+
+    oSymTable->capacity *= 2;
+    oSymTable->slots = SymTable_slots(oSymTable->capacity);
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old[i].used) {
+            oSymTable->slots[SymTable_find(oSymTable, old[i].pcKey)] = old[i];
+        }
+    }
+
+    Pool_free(old, old_capacity * sizeof(struct SymTable_bind));
 }
 
 SymTable_T SymTable_new(void) {
     /* Allocate memory for the new symbol table */
-    SymTable_T new = malloc(sizeof(struct SymTable));
-    unsigned int i;
+    SymTable_T new = Pool_alloc(sizeof(struct SymTable));
 
     /* Check allocated memory */
     if (new == NULL) {
@@ -36,32 +101,21 @@ SymTable_T SymTable_new(void) {
     }
 
     /* Initialize the new symbol table */
-    for (i = 0; i < HASHTABLE_SIZE; i++) {
-        new->table[i] = NULL;
-    }
+    new->capacity = SYMTABLE_INITIAL_CAPACITY;
+    new->slots = SymTable_slots(new->capacity);
     new->length = 0;
 
     return new;
 }
 
 void SymTable_free(SymTable_T oSymTable) {
-    struct SymTable_bind *tmp;
-    size_t i;
-
     /* Don't do anything if oSymTable == NULL */
     if (oSymTable == NULL)
         return;
 
-    /* Free each binding and its key in oSymTable */
-    for (i = 0; i < HASHTABLE_SIZE; i++) {
-        while ((tmp = oSymTable->table[i]) != NULL) {
-            oSymTable->table[i] = (oSymTable->table)[i]->next;
-            free(tmp);
-        }
-    }
-
-    /* Free the symbol table */
-    free(oSymTable);
+    /* Free the bindings and the symbol table */
+    Pool_free(oSymTable->slots, oSymTable->capacity * sizeof(struct SymTable_bind));
+    Pool_free(oSymTable, sizeof(struct SymTable));
 }
 
 unsigned int SymTable_getLength(SymTable_T oSymTable) {
@@ -71,150 +125,110 @@ unsigned int SymTable_getLength(SymTable_T oSymTable) {
 }
 
 int SymTable_put(SymTable_T oSymTable, const int pcKey, const void *pvValue) {
-    struct SymTable_bind *tmp;
-    unsigned int hashing;
+    unsigned int i;
 
     threadsafe_assert(oSymTable != NULL);
+    PREEMPT_DISABLE();
 
-    /* Calculate the hash of the given key % the size of the table */
-    hashing = SymTable_hash(pcKey);
+    i = SymTable_find(oSymTable, pcKey);
 
-    tmp = oSymTable->table[hashing];
-
-    /* Move through the chain to find if the key exists */
-    while (tmp != NULL && tmp->pcKey != pcKey) {
-        tmp = tmp->next;
+    /* If the key exists already, leave the table alone */
+    if (oSymTable->slots[i].used) {
+        PREEMPT_ENABLE();
+        return 0;
     }
 
-    /* If the key does not exist, create a new
-     * binding at the beginning of the chain */
-    if (tmp == NULL) {
-        /* Allocate memory for the new binding */
-        tmp = malloc(sizeof(struct SymTable_bind));
-
-        /* Check allocated memory */
-        if (tmp == NULL) {
-            printf("Ran out of memory while trying to allocate a new SymTable "
-                   "binding!\n"
-                   "Exiting now...");
-            exit(-1);
-        }
-
-        /* Set the data of the binding and connect it to the chain */
-        tmp->pcKey = pcKey;
-        tmp->value = (void *)pvValue;
-        tmp->next = oSymTable->table[hashing];
-        oSymTable->table[hashing] = tmp;
+    /* Make room first if the new binding would overload the table */
+    if ((oSymTable->length + 1) * SYMTABLE_MAX_LOAD_DEN > oSymTable->capacity * SYMTABLE_MAX_LOAD_NUM) {
+        SymTable_grow(oSymTable);
+        i = SymTable_find(oSymTable, pcKey);
+    }
 
-        /* Increase counter of bindings */
-        oSymTable->length++;
+    /* Set the data of the binding */
+    oSymTable->slots[i].pcKey = pcKey;
+    oSymTable->slots[i].value = (void *)pvValue;
+    oSymTable->slots[i].used = 1;
 
-        return 1;
-    }
+    /* Increase counter of bindings */
+    oSymTable->length++;
 
-    return 0;
+    PREEMPT_ENABLE();
+    return 1;
 }
 
 int SymTable_remove(SymTable_T oSymTable, const int pcKey) {
-    struct SymTable_bind *prev = NULL, *tmp;
-    unsigned int hashing;
+    unsigned int mask, i, j, home;
 
     threadsafe_assert(oSymTable != NULL);
+    PREEMPT_DISABLE();
 
-    /* Calculate the hash of the given key % the size of the table */
-    hashing = SymTable_hash(pcKey);
-    tmp = oSymTable->table[hashing];
-
-    /* If the binding is in the begining of the chain, remove it */
-    if (tmp != NULL && pcKey == tmp->pcKey) {
-        oSymTable->table[hashing] = oSymTable->table[hashing]->next;
-
-        free(tmp);
-
-        oSymTable->length--;
-
-        return 1;
-    }
+    mask = oSymTable->capacity - 1;
+    i = SymTable_find(oSymTable, pcKey);
 
-    /* Locate the binding, if it exists in the chain */
-    while (tmp != NULL && pcKey != tmp->pcKey) {
-        prev = tmp;
-        tmp = tmp->next;
+    if (!oSymTable->slots[i].used) {
+        PREEMPT_ENABLE();
+        return 0;
     }
 
-    /* If a binding with key==pcKey exists, remove it */
-    if (tmp != NULL) {
-        prev->next = tmp->next;
+    /* Close the gap: move back every following binding of the same run whose
+     * home slot is not between the gap and its current slot */
+    for (j = (i + 1) & mask; oSymTable->slots[j].used; j = (j + 1) & mask) {
+        home = SymTable_hash(oSymTable->slots[j].pcKey) & mask;
 
-        free(tmp);
-
-        oSymTable->length--;
-
-        return 1;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            oSymTable->slots[i] = oSymTable->slots[j];
+            i = j;
+        }
     }
+    oSymTable->slots[i].used = 0;
+
+    oSymTable->length--;
 
-    return 0;
+    PREEMPT_ENABLE();
+    return 1;
 }
 
+/* Lookups keep preemption disabled too, since a put from another thread may move the slots */
 int SymTable_contains(SymTable_T oSymTable, const int pcKey) {
-    struct SymTable_bind *tmp;
-    unsigned int hashing;
+    int found;
 
     threadsafe_assert(oSymTable != NULL);
+    PREEMPT_DISABLE();
 
-    /* Calculate the hash of the given key % the size of the table */
-    hashing = SymTable_hash(pcKey);
-    tmp = oSymTable->table[hashing];
+    /* Lookup the key in its run of slots */
+    found = oSymTable->slots[SymTable_find(oSymTable, pcKey)].used;
 
-    /* Lookup the key in the chain */
-    while (tmp != NULL && pcKey != tmp->pcKey) {
-        tmp = tmp->next;
-    }
-
-    /* Return if the key was found */
-    return (tmp != NULL);
+    PREEMPT_ENABLE();
+    return found;
 }
 
 void *SymTable_get(SymTable_T oSymTable, const int pcKey) {
-    struct SymTable_bind *tmp;
-    unsigned int hashing;
+    struct SymTable_bind *bind;
+    void *value;
 
     threadsafe_assert(oSymTable != NULL);
-
-    /* Calculate the hash of the given key % the size of the table */
-    hashing = SymTable_hash(pcKey);
-    tmp = oSymTable->table[hashing];
-
-    /* Lookup the key in the chain */
-    while (tmp != NULL && pcKey != tmp->pcKey) {
-        tmp = tmp->next;
-    }
+    PREEMPT_DISABLE();
 
     /* If found, return the value otherwise return NULL */
-    if (tmp != NULL) {
-        return tmp->value;
-    }
+    bind = &oSymTable->slots[SymTable_find(oSymTable, pcKey)];
+    value = bind->used ? bind->value : NULL;
 
-    return NULL;
+    PREEMPT_ENABLE();
+    return value;
 }
 
 void SymTable_map(SymTable_T oSymTable,
                   void (*pfApply)(const int pcKey, void *pvValue, void *pvExtra),
                   const void *pvExtra) {
-    struct SymTable_bind *tmp;
     unsigned int i;
 
     threadsafe_assert(oSymTable != NULL);
     threadsafe_assert(pfApply != NULL);
 
-    /* Call pfApply on each binding in every chain */
-    for (i = 0; i < HASHTABLE_SIZE; i++) {
-        tmp = oSymTable->table[i];
-
-        while (tmp != NULL) {
-            pfApply(tmp->pcKey, tmp->value, (void *)pvExtra);
-
-            tmp = tmp->next;
+    /* Call pfApply on each binding */
+    for (i = 0; i < oSymTable->capacity; i++) {
+        if (oSymTable->slots[i].used) {
+            pfApply(oSymTable->slots[i].pcKey, oSymTable->slots[i].value, (void *)pvExtra);
         }
     }
-}
\ No newline at end of file
+}
@@ -1,321 +1,1578 @@
 #include "thread.h"
 #include "DueTimerLib.h"
+#include "cond.h"
+#include "cycles.h"
+#include "rwlock.h"
 #include "sem.h"
 #include "threadsafe_libc.h"
+#include "trace.h"
 #include <limits.h>
 #include <signal.h>
 #include <stdint.h>
+#if linux && STACK_GUARD
+#include <sys/mman.h>
+#endif
 
 #define T Sem_T
 
+/* The host delivers the timer signal on the stack of the running thread, and an x86-64
+ * signal frame with AVX-512 state takes about 3.5 KB. At most two are stacked: the tick that
+ * switches, and one that only leaves itself pending. With the library's own frames the worst
+ * case measured by bench/stress.c is under 8 KB, the rest is left to the thread */
 #ifndef STACK_SIZE
+#if linux
+#define STACK_SIZE (16L * 1024)
+#else
 #define STACK_SIZE (8L * 1024)
 #endif
+#endif
+
+/* Stacks are pooled in NUM_STACK_CLASSES power of 2 size classes starting at MIN_STACK_SIZE.
+ * Larger stacks are allocated and freed individually */
+#ifndef MIN_STACK_SIZE
+#define MIN_STACK_SIZE 512
+#endif
+#ifndef NUM_STACK_CLASSES
+#define NUM_STACK_CLASSES 8
+#endif
+
+/* With STACK_CHECK, the lowest STACK_CANARY_WORDS words of every stack hold STACK_CANARY, which is
+ * checked on every switch. A thread that reaches the canaries is reported before it runs past its stack.
+ * With STACK_WATERMARK too, the rest of the stack is painted with STACK_PAINT when a thread is
+ * created, to measure its high-water mark. Painting is off by default: it writes the whole stack,
+ * which costs far more than the rest of Thread_new */
+#ifndef STACK_CHECK
+#define STACK_CHECK 1
+#endif
+#ifndef STACK_WATERMARK
+#define STACK_WATERMARK 0
+#endif
+#ifndef STACK_CANARY_WORDS
+#define STACK_CANARY_WORDS 4
+#endif
+#define STACK_CANARY 0xDEADBEEF
+#define STACK_PAINT 0xA5A5A5A5
 
-#define R0_OFFSET 0
-#define R1_OFFSET 1
-#define R2_OFFSET 2
-#define LR_OFFSET 13
-#define THRSTART_FRAME_SIZE (14 * 4)
+/* With STACK_GUARD on the Linux build, every stack is mapped with an inaccessible guard page
+ * below it so that an overflow faults right away */
+#ifndef STACK_GUARD
+#define STACK_GUARD 0
+#endif
+#define GUARD_SIZE 4096
+
+/* Layout of the frame _swtch pops to start a new thread in _thrstart, in stack words. It holds
+ * the registers saved by _swtch, through which _thrstart receives func, args and nbytes */
+#if ARDUINO_SAM_DUE
+// push {r0-r12, lr}. _thrstart calls r2 with r0 and r1 as arguments
+#define ARGS_OFFSET 0
+#define NBYTES_OFFSET 1
+#define FUNC_OFFSET 2
+#define RETURN_OFFSET 13
+#define THRSTART_FRAME_WORDS 14
+#define CODE_ADDRESS(f) ((uintptr_t)(f) | 1) // stay in Thumb state
+#elif linux && __x86_64__
+// r15, r14, r13, r12, rbx, rbp and the return address. _thrstart calls r14 with r12 and r13
+#define FUNC_OFFSET 1
+#define NBYTES_OFFSET 2
+#define ARGS_OFFSET 3
+#define RETURN_OFFSET 6
+#define THRSTART_FRAME_WORDS 7
+#define CODE_ADDRESS(f) ((uintptr_t)(f))
+#elif linux && i386
+// ebx, esi, edi, ebp and the return address. _thrstart pushes edi over the return address and
+// calls esi, which finds nbytes right above it. The rest pads the frame to 16 bytes
+#define FUNC_OFFSET 1
+#define ARGS_OFFSET 2
+#define RETURN_OFFSET 4
+#define NBYTES_OFFSET 5
+#define THRSTART_FRAME_WORDS 8
+#define CODE_ADDRESS(f) ((uintptr_t)(f))
+#endif
+#define THRSTART_FRAME_SIZE (THRSTART_FRAME_WORDS * sizeof(uintptr_t))
+
+/* A tid is the index of its descriptor in thread_table in the low TID_INDEX_BITS bits and a
+ * generation counter, bumped every time the descriptor is reused, in the remaining bits */
+#define TID_INDEX_BITS 16
+#define TID_INDEX_MASK ((1 << TID_INDEX_BITS) - 1)
+#define TID_GENERATION_MASK (INT_MAX >> TID_INDEX_BITS)
+
+/* Number of descriptors allocated by Thread_init. The table doubles whenever it runs out */
+#ifndef INITIAL_THREADS
+#define INITIAL_THREADS 8
+#endif
 
 #ifndef MAX_THREADS
-#define MAX_THREADS 8
+#define MAX_THREADS (1 << TID_INDEX_BITS)
 #endif
 
-#define BYTE_OFFSET_TO_WORD(offset) ((offset) / sizeof(uint32_t))
+#define BYTE_OFFSET_TO_WORD(offset) ((offset) / sizeof(uintptr_t))
 
+#define NUM_PRIORITIES (THREAD_PRIORITY_MAX + 1)
+
+/* Default preemption quantum in milliseconds */
+#ifndef PREEMPT_INTERVAL
 #define PREEMPT_INTERVAL 100
+#endif
+
+/* Number of slots in the timeout wheel. Must be a power of 2 */
+#ifndef WHEEL_SIZE
+#define WHEEL_SIZE 64
+#endif
+#define WHEEL_MASK (WHEEL_SIZE - 1)
 
 typedef enum {
     INVALID,      // This thread is not valid and shouldn't run
-    RUNNING,      // Running or able to run
+    RUNNING,      // Running or able to run (in the run queue unless it is current_thread)
     WAIT_AT_JOIN, // Waiting at Thread_join for some thread(s) to exit
-    WAIT_FOR_SEM  // Waiting for a semaphore to be raised
+    WAIT_FOR_SEM, // Waiting for a semaphore to be raised
+    WAIT_FOR_MUTEX, // Waiting in Mutex_lock for a mutex to be unlocked
+    WAIT_FOR_COND, // Waiting in Cond_wait for a condition variable to be signaled
+    WAIT_FOR_RWLOCK, // Waiting in RWLock_rdlock or RWLock_wrlock for a reader-writer lock
+    SLEEPING      // Waiting in Thread_sleep_us for its timeout
 } ThreadState;
 
-void _STARTMONITOR() {}
-extern void _ENDMONITOR();
-
 extern void _swtch(void *from, void *to);
 extern void _thrstart(void);
 
 typedef struct Thread {
     int id;
     ThreadState status; // (1) Ready (2) Running (3) Waiting (4) Delayed (5) Blocked
+    int priority;       // THREAD_PRIORITY_MIN..THREAD_PRIORITY_MAX, selects the run queue
+    int base_priority;  // set by the user. priority is higher while it lends from a mutex waiter
 
     uint32_t wait_for_ID; // waiting for thread with ID = wait_for_ID
-    uint32_t waiting_for_sem;
+    T *waiting_for_sem;
+    Mutex_T *waiting_for_mutex; // also the mutex to reacquire while WAIT_FOR_COND
+    Mutex_T *held_mutexes; // priority inheriting mutexes owned, linked through next_held
 
-    uint32_t *sp;
-    uint32_t *stack; // used for free();
+    uintptr_t *sp;
+    uintptr_t *stack;   // used for free();
+    size_t stack_size; // bytes at stack
 
     int returned_value;
+    int (*func)(void *, size_t); // what the thread runs, called by thread_start
+
+    IQueue_link link; // in the run queue, a wait queue, a joiner list or the free list
+
+    IQueue_t joiners; // threads blocked in Thread_join on this thread
+
+    uint32_t wake_tick;           // tick at which a timed wait expires
+    struct Thread *wheel_next;    // next thread in the same timeout wheel slot
+    struct Thread **wheel_pprev;  // link pointing to this thread, NULL if no timeout is pending
+    int timed_out;                // the last timed wait expired instead of being satisfied
+
+    // Accounting reported by Thread_stats
+    cycles_t run_start;            // when the thread was last switched in
+    cycles_t block_start;          // when the thread last blocked
+    uint64_t cpu_cycles;           // time spent running, up to the last switch out
+    uint64_t blocked_cycles;       // time spent blocked on semaphores, mutexes, condition variables, locks and joins
+    uint32_t voluntary_switches;   // times it blocked or gave up the processor with Thread_pause
+    uint32_t involuntary_switches; // times it was preempted by the timer or a higher priority thread
+    uint32_t preemptions_skipped;  // ticks deferred because it had preemption disabled
 } Thread;
 
-static Thread thread_table[MAX_THREADS]; // ALL THREADS
+static Thread **thread_table; // ALL THREADS, indexed by the low bits of their tid
+static int table_size;        // number of descriptors in thread_table
+static IQueue_t free_threads; // INVALID descriptors ready for reuse, most recently released first
+
+/* Free stacks of each size class, linked through their first word */
+static uintptr_t *stack_pool[NUM_STACK_CLASSES];
 
 static Thread *current_thread = NULL; /* The currently running thread */
 static Thread *pending_free = NULL;   /* A thread that has finished but hasn't been freed yet to allow for switching */
 
+/* One FIFO per priority of threads that are able to run, excluding current_thread.
+ * Bit p of ready_bitmap is set while the queue of priority p is not empty */
+static IQueue_t runq[NUM_PRIORITIES];
+static uint32_t ready_bitmap;
+
 static int existing_threads; // num of threads not INVALID
-static int waiting_for_zero;
+static Thread *zero_joiner;  // the one thread blocked in Thread_join(0), if any
 
 static Timer_t *timer;
+static int tick_us;       // timer period, the preemption quantum and the resolution of timeouts
+static int preemptive;    // 0 if preemption has been disabled with Thread_set_quantum(0)
+static int timer_running; // the timer is stopped at the first tick with no other thread to switch to and no timeout
+
+/* Threads with a pending timeout, hashed by wake_tick. A slot may hold threads from later rounds */
+static Thread *wheel[WHEEL_SIZE];
+static int sleepers;                    // number of threads in the wheel
+static volatile uint32_t ticks_elapsed; // incremented by every timer interrupt
+static uint32_t now_tick;               // last tick processed by advance_timeouts
+
+/* Return 1 if thr is blocked on a synchronization object or a join, whose time counts as blocked */
+static int thread_waiting(Thread *thr) {
+    return thr->status == WAIT_FOR_SEM || thr->status == WAIT_FOR_MUTEX || thr->status == WAIT_FOR_COND ||
+           thr->status == WAIT_FOR_RWLOCK || thr->status == WAIT_AT_JOIN;
+}
+
+/* Append thr to the end of queue */
+static void thread_enqueue(IQueue_t *queue, Thread *thr) {
+    iqueue_append(queue, &thr->link);
+}
+
+/* Remove and return the thread at the start of queue, or NULL if it is empty */
+static Thread *thread_dequeue(IQueue_t *queue) {
+    IQueue_link *link = iqueue_pop(queue);
+
+    return link ? IQUEUE_ENTRY(link, Thread, link) : NULL;
+}
+
+/* Remove thr from queue. Returns 0 if it wasn't there */
+static int thread_remove(IQueue_t *queue, Thread *thr) {
+    return iqueue_remove(queue, &thr->link);
+}
+
+/* Put thr in the timeout wheel slot of its wake_tick */
+static void wheel_insert(Thread *thr) {
+    Thread **slot = &wheel[thr->wake_tick & WHEEL_MASK];
+
+    thr->wheel_next = *slot;
+    if (*slot) {
+        (*slot)->wheel_pprev = &thr->wheel_next;
+    }
+    thr->wheel_pprev = slot;
+    *slot = thr;
+    ++sleepers;
+}
+
+/* Take thr out of the timeout wheel */
+static void wheel_remove(Thread *thr) {
+    *thr->wheel_pprev = thr->wheel_next;
+    if (thr->wheel_next) {
+        thr->wheel_next->wheel_pprev = thr->wheel_pprev;
+    }
+    thr->wheel_next = NULL;
+    thr->wheel_pprev = NULL;
+    --sleepers;
+}
+
+/* Return 1 if a thread with a priority of at least `priority` is in the run queue */
+static int ready_at_least(int priority) {
+    return (ready_bitmap >> priority) != 0;
+}
+
+/* Return 1 if a thread of higher priority than running is ready */
+static int outranked(Thread *running) {
+    return running->priority < THREAD_PRIORITY_MAX && ready_at_least(running->priority + 1);
+}
+
+/* Return 1 if a tick could actually switch `running` to another thread, i.e. if a thread of
+ * the same priority is ready, or if a timeout is pending. Higher priority threads never wait
+ * for a tick */
+static int timer_needed(Thread *running) {
+    return (preemptive && running && ready_at_least(running->priority)) || sleepers > 0;
+}
+
+/* Start the timer if it is stopped and now needed. It is only stopped by the tick that finds
+ * nothing to do, since stopping it whenever the run queue empties would cost a syscall on
+ * almost every block and wakeup */
+static void update_timer(Thread *running) {
+    if (!timer_running && timer_needed(running)) {
+        start_timer(timer);
+        timer_running = 1;
+    }
+}
+
+/* Mark thr as able to run and append it to the end of the run queue of its priority */
+static void make_runnable(Thread *thr) {
+    if (thr->wheel_pprev) {
+        wheel_remove(thr);
+    }
+    if (thr->status != RUNNING) {
+        TRACE(TRACE_WAKEUP, thr->id, thr->timed_out ? 0 : current_thread->id);
+    }
+    if (thread_waiting(thr)) {
+        thr->blocked_cycles += (cycles_t)(cycles_now() - thr->block_start);
+    }
+
+    thr->status = RUNNING;
+    thread_enqueue(&runq[thr->priority], thr);
+    ready_bitmap |= 1UL << thr->priority;
+    update_timer(current_thread);
+}
 
+/* Take a thread in the RUNNING state out of the run queue */
+static void remove_runnable(Thread *thr) {
+    thread_remove(&runq[thr->priority], thr);
+    if (iqueue_isEmpty(&runq[thr->priority])) {
+        ready_bitmap &= ~(1UL << thr->priority);
+    }
+}
+
+/* Remove and return the first thread of the highest priority run queue, or NULL if all are empty */
 static Thread *select_runnable_thread() {
-    static int last_I = 0;
-    Thread *sel_thread = NULL;
-
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (thread_table[(i + last_I) % MAX_THREADS].status == RUNNING) {
-            sel_thread = &thread_table[(i + last_I) % MAX_THREADS];
-            last_I = (i + last_I + 1) % MAX_THREADS;
-            return sel_thread;
+    Thread *thr = NULL;
+
+    if (ready_bitmap) {
+        // The highest set bit is the highest priority with a ready thread
+        int priority = 31 - __builtin_clz(ready_bitmap);
+
+        thr = thread_dequeue(&runq[priority]);
+        if (iqueue_isEmpty(&runq[priority])) {
+            ready_bitmap &= ~(1UL << priority);
         }
+        // Whatever switch follows serves a deferred preemption
+        preempt_pending = 0;
     }
 
-    return NULL;
+    update_timer(thr);
+    return thr;
 }
 
-/* Return a free ID: Currently just return the last ID+1 */
-static int get_new_tid() {
-    static int counter = 1;
+/* Double the size of thread_table and put the new descriptors in the free list.
+ * Returns 0 if the table is already at MAX_THREADS or memory ran out, 1 otherwise */
+static int grow_thread_table() {
+    int new_size = table_size ? table_size * 2 : INITIAL_THREADS;
+
+    if (new_size > MAX_THREADS) {
+        new_size = MAX_THREADS;
+    }
+    if (new_size <= table_size) {
+        return 0;
+    }
+
+    Thread **new_table = malloc(new_size * sizeof(Thread *));
+    Thread *descriptors = calloc(new_size - table_size, sizeof(Thread));
+
+    if (!new_table || !descriptors) {
+        free(new_table);
+        free(descriptors);
+        return 0;
+    }
+
+    if (thread_table) {
+        memcpy(new_table, thread_table, table_size * sizeof(Thread *));
+        free(thread_table);
+    }
+    thread_table = new_table;
+
+    // Push in reverse so that lower indices are handed out first
+    for (int i = new_size - 1; i >= table_size; i--) {
+        Thread *thr = &descriptors[i - table_size];
+
+        thr->id = i; // generation 0, never handed out
+        thr->status = INVALID;
+        iqueue_push(&free_threads, &thr->link);
+
+        thread_table[i] = thr;
+    }
+    table_size = new_size;
+
+    return 1;
+}
+
+/* Take a descriptor from the free list and give it a new tid. Returns NULL if none is available */
+static Thread *alloc_thread() {
+    if (iqueue_isEmpty(&free_threads) && !grow_thread_table()) {
+        return NULL;
+    }
+
+    Thread *thr = thread_dequeue(&free_threads);
+
+    int generation = ((thr->id >> TID_INDEX_BITS) + 1) & TID_GENERATION_MASK;
+    if (!generation) {
+        generation = 1;
+    }
+    thr->id = (generation << TID_INDEX_BITS) | (thr->id & TID_INDEX_MASK);
+
+    thr->cpu_cycles = thr->blocked_cycles = 0;
+    thr->voluntary_switches = thr->involuntary_switches = thr->preemptions_skipped = 0;
 
-    return counter++;
+    return thr;
 }
 
+/* Put an INVALID descriptor back in the free list. Its stack is kept for the next thread */
+static void release_thread(Thread *thr) {
+    iqueue_push(&free_threads, &thr->link);
+}
+
+/* Semaphore ids only tell semaphores apart in the trace, so they may wrap around, but stay
+ * positive */
 static int get_new_sid() {
-    static int counter = 1;
+    static unsigned counter = 1;
+
+    return (int)(counter++ & INT_MAX);
+}
+
+/* Return the size class of a stack of at least size bytes, or -1 if it is too large to be pooled */
+static int stack_class(size_t size) {
+    for (int c = 0; c < NUM_STACK_CLASSES; c++) {
+        if (size <= ((size_t)MIN_STACK_SIZE << c)) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+/* Round size up to the size of the stack that will actually be allocated for it */
+static size_t stack_round(size_t size) {
+    int c = stack_class(size);
+
+    if (c < 0) {
+        return (size + 15) & ~(size_t)15; // keep the top of the stack 16 byte aligned
+    }
+
+    return (size_t)MIN_STACK_SIZE << c;
+}
+
+/* Allocate a new stack of size bytes, preceded by a guard page with STACK_GUARD */
+static uintptr_t *stack_map(size_t size) {
+#if linux && STACK_GUARD
+    char *base = mmap(NULL, size + GUARD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED && mprotect(base, GUARD_SIZE, PROT_NONE) != 0) {
+        munmap(base, size + GUARD_SIZE);
+        base = MAP_FAILED;
+    }
+
+    return base == MAP_FAILED ? NULL : (uintptr_t *)(base + GUARD_SIZE);
+#else
+    return malloc(size);
+#endif
+}
+
+/* Return a stack of size bytes, as returned by stack_round, reusing a pooled one if possible */
+static uintptr_t *stack_alloc(size_t size) {
+    int c = stack_class(size);
+    uintptr_t *stack;
+
+    if (c >= 0 && stack_pool[c]) {
+        stack = stack_pool[c];
+        stack_pool[c] = *(uintptr_t **)stack;
+        return stack;
+    }
+
+    return stack_map(size);
+}
+
+/* Give a stack back to the pool of its size class */
+static void stack_free(uintptr_t *stack, size_t size) {
+    int c = stack_class(size);
+
+    if (c < 0) {
+#if linux && STACK_GUARD
+        munmap((char *)stack - GUARD_SIZE, size + GUARD_SIZE);
+#else
+        free(stack);
+#endif
+        return;
+    }
+
+    *(uintptr_t **)stack = stack_pool[c];
+    stack_pool[c] = stack;
+}
+
+/* Put the canaries at the bottom of the stack of thr and, with STACK_WATERMARK, fill the rest
+ * below its initial frame with STACK_PAINT */
+static void stack_paint(Thread *thr) {
+#if STACK_CHECK
+    uintptr_t *p = thr->stack;
+
+    while (p < &thr->stack[STACK_CANARY_WORDS]) {
+        *p++ = STACK_CANARY;
+    }
+#if STACK_WATERMARK
+    while (p < thr->sp) {
+        *p++ = STACK_PAINT;
+    }
+#endif
+#endif
+}
+
+#if STACK_CHECK
+/* Return 1 if the canaries at the bottom of the stack of thr are intact */
+static int stack_intact(Thread *thr) {
+    for (int i = 0; i < STACK_CANARY_WORDS; i++) {
+        if (thr->stack[i] != STACK_CANARY) {
+            return 0;
+        }
+    }
 
-    return counter++;
+    return 1;
+}
+#endif
+
+/* Abort if the thread about to be switched out has reached the bottom of its stack */
+static void stack_check(Thread *thr) {
+#if STACK_CHECK
+    threadsafe_assert((!thr->stack || stack_intact(thr)) && "Runtime error: Stack overflow");
+#endif
+}
+
+/* Charge prev for the time it ran since it was switched in and start the clock of next */
+static void account_switch(Thread *prev, Thread *next) {
+    cycles_t now = cycles_now();
+
+    prev->cpu_cycles += (cycles_t)(now - prev->run_start);
+    next->run_start = now;
 }
 
 /* Deallocate a thread descriptor  */
 static void Thread_destroy(Thread *thr) {
-    free(thr->stack);
+    stack_free(thr->stack, thr->stack_size);
     thr->stack = NULL;
 }
 
 /* Shutdown the threading system. Should be called before exiting  */
 static void Thread_shutdown() {}
 
-/* Return 1 if the thread `tid` exists, otherwise 0. */
-static int Thread_exists(int tid) {
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (thread_table[i].id == tid && thread_table[i].status == RUNNING) {
-            return 1;
+/* Return the descriptor of the thread `tid` if it exists, otherwise NULL. */
+static Thread *Thread_find(int tid) {
+    int index = tid & TID_INDEX_MASK;
+
+    if (tid <= 0 || index >= table_size) {
+        return NULL;
+    }
+
+    Thread *thr = thread_table[index];
+
+    // A stale tid names a descriptor that has since been reused with a newer generation
+    if (thr->id != tid || thr->status == INVALID) {
+        return NULL;
+    }
+
+    return thr;
+}
+
+/* A timed wait of thr has expired: take it out of whatever it was waiting on and let it run */
+static void expire_timeout(Thread *thr) {
+    if (thr->status == WAIT_FOR_SEM) {
+        thread_remove(&thr->waiting_for_sem->waiters, thr);
+        thr->waiting_for_sem = NULL;
+    } else if (thr->status == WAIT_AT_JOIN) {
+        Thread *target = Thread_find(thr->wait_for_ID);
+
+        if (target) {
+            thread_remove(&target->joiners, thr);
+        } else {
+            zero_joiner = NULL;
         }
     }
 
-    return 0;
+    thr->timed_out = 1;
+    make_runnable(thr);
+}
+
+/* Expire the timeouts of every tick counted by the timer since the last call */
+static void advance_timeouts() {
+    if (!sleepers) {
+        now_tick = ticks_elapsed;
+        return;
+    }
+
+    while (now_tick != ticks_elapsed) {
+        ++now_tick;
+
+        Thread *thr = wheel[now_tick & WHEEL_MASK];
+        while (thr) {
+            Thread *next = thr->wheel_next;
+
+            if ((int32_t)(now_tick - thr->wake_tick) >= 0) {
+                expire_timeout(thr);
+            }
+            thr = next;
+        }
+    }
+}
+
+/* Arm a timeout of usecs, rounded up to whole ticks, for the current thread, which is about to block */
+static void start_timeout(int usecs) {
+    uint32_t ticks = ((uint32_t)usecs + tick_us - 1) / tick_us;
+
+    advance_timeouts();
+
+    current_thread->wake_tick = now_tick + (ticks ? ticks : 1);
+    wheel_insert(current_thread);
+    update_timer(current_thread);
+}
+
+/* Return the next thread to run. If none is ready but timeouts are pending, wait for the
+ * timer to expire one. Returns NULL only if nothing will ever become ready */
+static Thread *wait_runnable_thread() {
+    Thread *thr;
+
+    // Preemption is disabled, so the ticks that end the wait are only counted by the handler
+    while (!(thr = select_runnable_thread()) && sleepers) {
+        while (now_tick == ticks_elapsed) {
+            wait_for_interrupt();
+        }
+        advance_timeouts();
+    }
+
+    return thr;
+}
+
+/* Save the registers of prev and resume next. Every thread switches with preemption disabled,
+ * but not always as deeply nested, so the one that resumes here gets its own count back */
+static void switch_to(Thread *prev, Thread *next) {
+    int count = preempt_count;
+
+    _swtch(&prev->sp, &next->sp);
+    preempt_count = count;
 }
 
-/* Runs every PREEMPT_INTERVAL usecs to switch between threads.
- * Doesn't run if at the time of the timer signal a thread library
- * function is still executing or while executing a threadsafe_libc function.
+/* Switch away from the current thread, which has already been put in some wait queue */
+static void block_current() {
+    Thread *prev_thread = current_thread;
+
+    TRACE(TRACE_BLOCK, prev_thread->id,
+          prev_thread->status == WAIT_AT_JOIN      ? TRACE_BLOCK_JOIN
+          : prev_thread->status == WAIT_FOR_SEM    ? TRACE_BLOCK_SEM
+          : prev_thread->status == WAIT_FOR_MUTEX  ? TRACE_BLOCK_MUTEX
+          : prev_thread->status == WAIT_FOR_COND   ? TRACE_BLOCK_COND
+          : prev_thread->status == WAIT_FOR_RWLOCK ? TRACE_BLOCK_RWLOCK
+                                                   : TRACE_BLOCK_SLEEP);
+    prev_thread->timed_out = 0;
+
+    // The time spent idle below, waiting for a timeout, is charged to nobody
+    prev_thread->block_start = cycles_now();
+    prev_thread->cpu_cycles += (cycles_t)(prev_thread->block_start - prev_thread->run_start);
+    ++prev_thread->voluntary_switches;
+
+    current_thread = wait_runnable_thread();
+    threadsafe_assert(current_thread && "Deadlock detected: No threads in run queue");
+    current_thread->run_start = cycles_now();
+
+    // While idle, the blocked thread may have been woken up by its own timeout
+    if (current_thread != prev_thread) {
+        stack_check(prev_thread);
+        TRACE(TRACE_SWITCH, current_thread->id, prev_thread->id);
+        switch_to(prev_thread, current_thread);
+    }
+}
+
+static void yield_current(int voluntary);
+static void yield_if_outranked();
+
+/* Expire timeouts and give the processor to a ready thread of higher priority or, if
+ * preemptive, of the same priority. Stop the timer if neither is left to do. Called with
+ * preemption disabled, also to take a switch deferred by yield_if_outranked, which must
+ * happen whatever the quantum */
+static void run_tick() {
+    preempt_pending = 0;
+    advance_timeouts();
+
+    if (outranked(current_thread) || (preemptive && ready_at_least(current_thread->priority))) {
+        yield_current(0);
+    } else if (timer_running && !sleepers) {
+        stop_timer(timer);
+        timer_running = 0;
+    }
+}
+
+/* Runs every tick to expire timeouts and, every quantum, to switch between threads.
+ * The timer backend calls it with preempt_count raised by one, which keeps the next tick
+ * from nesting inside it. Doesn't run while preemption was disabled by the interrupted code,
+ * that is while a thread library or threadsafe_libc function is executing or inside
+ * Thread_preempt_disable. The tick is still counted and, if it had work to do, left pending
+ * for the PREEMPT_ENABLE that ends the disabled region.
  */
 static void handler(Context *ctx) {
-    if (in_libc_flag)
-        return;
-    if ((int)_STARTMONITOR <= ctx->return_PC && ctx->return_PC <= (int)_ENDMONITOR)
+    (void)ctx;
+    ++ticks_elapsed;
+
+    if (preempt_count > 1) {
+        // Only reading the bitmap and the wheel, which is consistent enough for a hint
+        if (outranked(current_thread) || (preemptive && ready_at_least(current_thread->priority))) {
+            ++current_thread->preemptions_skipped;
+            preempt_pending = 1;
+        } else if (sleepers) {
+            preempt_pending = 1;
+        }
         return;
+    }
 
-    Thread_pause();
+    run_tick();
+}
+
+/* Take the tick deferred by the handler. preempt_count has just dropped to 0. A tick that
+ * comes meanwhile stays pending rather than being taken here recursively */
+void thread_preempt_point(void) {
+    PREEMPT_DISABLE();
+    run_tick();
+    preempt_barrier();
+    --preempt_count;
+}
+
+void Thread_preempt_disable(void) {
+    PREEMPT_DISABLE();
+}
+
+void Thread_preempt_enable(void) {
+    threadsafe_assert(preempt_count > 0 && "Runtime error: Thread_preempt_enable without Thread_preempt_disable");
+    PREEMPT_ENABLE();
+}
+
+/* Where every thread starts, called by _thrstart with the arguments given to Thread_new. It
+ * inherits the count of the switch that resumed it */
+static int thread_start(void *args, size_t nbytes) {
+    preempt_count = 1;
+    PREEMPT_ENABLE();
+
+    return current_thread->func(args, nbytes);
 }
 
 void Thread_init() {
-    for (int i = 0; i < MAX_THREADS; i++) {
-        thread_table[i].status = INVALID;
+    PREEMPT_DISABLE();
+    thread_table = NULL;
+    table_size = 0;
+    iqueue_init(&free_threads);
+
+    zero_joiner = NULL;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+        iqueue_init(&runq[i]);
     }
+    ready_bitmap = 0;
 
-    waiting_for_zero = 0;
-
-    thread_table[0].id = get_new_tid();
-    thread_table[0].status = RUNNING;
-    thread_table[0].stack = NULL;
+    for (int i = 0; i < WHEEL_SIZE; i++) {
+        wheel[i] = NULL;
+    }
+    for (int i = 0; i < NUM_STACK_CLASSES; i++) {
+        stack_pool[i] = NULL;
+    }
+    sleepers = 0;
+    ticks_elapsed = now_tick = 0;
+
+    current_thread = alloc_thread();
+    threadsafe_assert(current_thread && "Cannot allocate thread table");
+
+    current_thread->status = RUNNING;
+    current_thread->priority = current_thread->base_priority = THREAD_PRIORITY_DEFAULT;
+    current_thread->waiting_for_mutex = current_thread->held_mutexes = NULL;
+    current_thread->stack = NULL;
+    current_thread->stack_size = 0;
+    iqueue_init(&current_thread->joiners);
     existing_threads = 1;
 
-    current_thread = &thread_table[0];
+    cycles_init();
+    current_thread->run_start = cycles_now();
+#if THREAD_TRACE
+    Trace_init();
+#endif
 
     timer = get_available_timer();
-    set_timer(timer, 100000, handler);
+    tick_us = 0;
+    preemptive = 0;
+    timer_running = 0;
+    Thread_set_quantum(PREEMPT_INTERVAL * 1000);
+    PREEMPT_ENABLE();
 }
 
-int Thread_new(int func(void *, size_t), void *args, size_t nbytes, ...) {
-    Thread *thread_descriptor = NULL;
+void Thread_set_quantum(int usecs) {
+    threadsafe_assert(usecs >= 0 && "Runtime error: The quantum cannot be negative");
+    PREEMPT_DISABLE();
+
+    // With preemption disabled the timer keeps its last period and only runs for timeouts
+    if (usecs > 0) {
+        tick_us = usecs;
+        set_timer(timer, usecs, handler);
+        timer_running = 1;
+    }
+    preemptive = usecs > 0;
 
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if (thread_table[i].status == INVALID) {
-            thread_descriptor = &thread_table[i];
+    if (timer_running && !timer_needed(current_thread)) {
+        stop_timer(timer);
+        timer_running = 0;
+    }
+    update_timer(current_thread);
+    PREEMPT_ENABLE();
+}
+
+void Thread_attr_init(Thread_attr *attr) {
+    threadsafe_assert(attr && "Thread attributes cannot be NULL");
+    attr->priority = THREAD_PRIORITY_DEFAULT;
+    attr->stack_size = 0;
+}
+
+int Thread_reserve_stacks(size_t stack_size, int count) {
+    size_t size = stack_round(stack_size ? stack_size : STACK_SIZE);
+    int reserved;
+
+    if (stack_class(size) < 0) {
+        return 0;
+    }
+
+    PREEMPT_DISABLE();
+    for (reserved = 0; reserved < count; reserved++) {
+        uintptr_t *stack = stack_map(size);
 
+        if (!stack) {
             break;
         }
+        stack_free(stack, size);
     }
+    PREEMPT_ENABLE();
+
+    return reserved;
+}
+
+int Thread_new(int func(void *, size_t), void *args, size_t nbytes, ...) {
+    return Thread_new_attr(func, args, nbytes, NULL);
+}
 
-    if (!thread_descriptor)
+int Thread_new_attr(int func(void *, size_t), void *args, size_t nbytes, const Thread_attr *attr) {
+    Thread_attr defaults;
+
+    if (!attr) {
+        Thread_attr_init(&defaults);
+        attr = &defaults;
+    }
+    threadsafe_assert(THREAD_PRIORITY_MIN <= attr->priority && attr->priority <= THREAD_PRIORITY_MAX &&
+                      "Runtime error: Invalid thread priority");
+    PREEMPT_DISABLE();
+
+    Thread *thread_descriptor = alloc_thread();
+
+    if (!thread_descriptor) {
+        PREEMPT_ENABLE();
         return -1;
+    }
 
-    thread_descriptor->id = get_new_tid();
-    thread_descriptor->status = RUNNING;
-    thread_descriptor->waiting_for_sem = 0;
+    thread_descriptor->priority = thread_descriptor->base_priority = attr->priority;
+    thread_descriptor->func = func;
+    thread_descriptor->waiting_for_sem = NULL;
+    thread_descriptor->waiting_for_mutex = thread_descriptor->held_mutexes = NULL;
+    iqueue_init(&thread_descriptor->joiners);
     ++existing_threads;
 
+    // Keep the stack left over in the descriptor if it has the right size, otherwise swap it
+    size_t stack_size = stack_round(attr->stack_size ? attr->stack_size : STACK_SIZE);
+
+    if (thread_descriptor->stack && thread_descriptor->stack_size != stack_size) {
+        Thread_destroy(thread_descriptor);
+    }
     if (!thread_descriptor->stack) {
-        thread_descriptor->stack = malloc(STACK_SIZE);
+        thread_descriptor->stack = stack_alloc(stack_size);
+        thread_descriptor->stack_size = stack_size;
     }
     threadsafe_assert(thread_descriptor->stack && "Cannot allocate stack");
+    threadsafe_assert(stack_size > THRSTART_FRAME_SIZE + STACK_CANARY_WORDS * sizeof(uintptr_t) &&
+                      "Runtime error: Stack too small");
 
     // Allocate stack frame
-    thread_descriptor->sp = &thread_descriptor->stack[BYTE_OFFSET_TO_WORD(STACK_SIZE - THRSTART_FRAME_SIZE)];
+    thread_descriptor->sp = &thread_descriptor->stack[BYTE_OFFSET_TO_WORD(stack_size - THRSTART_FRAME_SIZE)];
 
-    /* Save address of args to the location that will be restored in R0 after context switch */
-    thread_descriptor->sp[R0_OFFSET] = (uint32_t)args;
-
-    /* Save nbytes to the location that will be restored in R1 after context switch */
-    thread_descriptor->sp[R1_OFFSET] = (uint32_t)nbytes;
+    for (int i = 0; i < THRSTART_FRAME_WORDS; i++) {
+        thread_descriptor->sp[i] = 0;
+    }
 
-    /* Save address of func to the location that will be restored in R2 after context switch */
-    thread_descriptor->sp[R2_OFFSET] = ((uint32_t)func) | 1;
+    /* Save args, nbytes and thread_start where _swtch restores the registers _thrstart takes them from */
+    thread_descriptor->sp[ARGS_OFFSET] = (uintptr_t)args;
+    thread_descriptor->sp[NBYTES_OFFSET] = (uintptr_t)nbytes;
+    thread_descriptor->sp[FUNC_OFFSET] = CODE_ADDRESS(thread_start);
 
     /* Save address of _thrstart to the location that will be used as return after context switch */
-    thread_descriptor->sp[LR_OFFSET] = ((uint32_t)_thrstart) | 1;
+    thread_descriptor->sp[RETURN_OFFSET] = CODE_ADDRESS(_thrstart);
+
+    stack_paint(thread_descriptor);
+
+    TRACE(TRACE_CREATE, thread_descriptor->id, current_thread->id);
+
+    make_runnable(thread_descriptor);
+
+    int tid = thread_descriptor->id;
 
-    return thread_descriptor->id;
+    // Let a new thread of higher priority run right away
+    yield_if_outranked();
+    PREEMPT_ENABLE();
+
+    return tid;
 }
 
+/* Preemption stays disabled until the switch, and the next thread restores its own count */
 void Thread_exit(int code) {
+    PREEMPT_DISABLE();
+
     if (pending_free && pending_free->stack && pending_free->status == INVALID) {
         Thread_destroy(pending_free);
         pending_free = NULL;
     }
 
+    TRACE(TRACE_EXIT, current_thread->id, code);
+
     current_thread->status = INVALID;
     --existing_threads;
+    release_thread(current_thread);
 
     // Put all threads waiting for the current thread back into the run queue
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if ((thread_table[i].status == WAIT_AT_JOIN) && (current_thread->id == thread_table[i].wait_for_ID)) {
-            thread_table[i].returned_value = code;
-            thread_table[i].status = RUNNING;
-        }
+    Thread *joiner;
+    while ((joiner = thread_dequeue(&current_thread->joiners))) {
+        joiner->returned_value = code;
+        make_runnable(joiner);
     }
 
     Thread *next_thread = select_runnable_thread();
 
-    // If there is no thread to run, either exit or restore the one thread that has called join(0)
+    // If the one thread left has called join(0), it can now return
+    if (!next_thread && existing_threads == 1 && zero_joiner) {
+        zero_joiner->returned_value = 0;
+        make_runnable(zero_joiner);
+        zero_joiner = NULL;
+        next_thread = select_runnable_thread();
+    }
+
+    // If there is no thread to run, either exit or wait for a timeout to wake one up
     // Otherwise, switch to the next thread
     if (!next_thread) {
         if (existing_threads == 0) {
             Thread_shutdown();
             exit(code);
-        } else if (existing_threads == 1) {
-            for (int i = 0; i < MAX_THREADS; i++) {
-                if ((thread_table[i].status == WAIT_AT_JOIN) && (thread_table[i].wait_for_ID == 0)) {
-                    waiting_for_zero--;
-
-                    thread_table[i].returned_value = 0;
-                    thread_table[i].status = RUNNING;
+        }
 
-                    uint32_t **curr_sp = &current_thread->sp;
+        next_thread = wait_runnable_thread();
 
-                    pending_free = current_thread;
-                    current_thread = &thread_table[i];
-                    _swtch(curr_sp, &current_thread->sp);
-                }
-            }
+        if (!next_thread && existing_threads == 1) {
             threadsafe_assert(0 && "Deadlock detected: No threads in run queue, one task remaining, not joining with 0");
-        } else {
+        } else if (!next_thread) {
             threadsafe_assert(0 && "Deadlock detected: No threads in run queue, many threads remaining sleeping");
         }
-    } else {
-        uint32_t **curr_sp = &current_thread->sp;
+    }
+
+    stack_check(current_thread);
+    TRACE(TRACE_SWITCH, next_thread->id, current_thread->id);
+    next_thread->run_start = cycles_now();
+
+    uintptr_t **curr_sp = &current_thread->sp;
 
-        pending_free = current_thread;
-        current_thread = next_thread;
-        _swtch(curr_sp, &next_thread->sp);
+    pending_free = current_thread;
+    current_thread = next_thread;
+    _swtch(curr_sp, &next_thread->sp);
+}
+
+/* The stack high-water mark of thr as returned by Thread_stack_usage */
+static int stack_usage(Thread *thr) {
+#if STACK_CHECK && STACK_WATERMARK
+    if (!thr || !thr->stack) {
+        return -1;
+    }
+    if (!stack_intact(thr)) {
+        return (int)thr->stack_size;
     }
+
+    // The stack grows down, so the paint left at the bottom was never touched
+    size_t untouched = STACK_CANARY_WORDS;
+    while (untouched < BYTE_OFFSET_TO_WORD(thr->stack_size) && thr->stack[untouched] == STACK_PAINT) {
+        untouched++;
+    }
+
+    return (int)(thr->stack_size - untouched * sizeof(uintptr_t));
+#else
+    (void)thr;
+    return -1;
+#endif
+}
+
+int Thread_stack_usage(int tid) {
+    PREEMPT_DISABLE();
+    int used = stack_usage(Thread_find(tid));
+    PREEMPT_ENABLE();
+
+    return used;
+}
+
+/* Fill out with the statistics of thr, converting cycles at cycles_per_ms */
+static void fill_stats(Thread *thr, Thread_stats_T *out, uint32_t per_ms) {
+    uint64_t cpu = thr->cpu_cycles;
+    uint64_t blocked = thr->blocked_cycles;
+
+    // Include the slice the thread is in the middle of
+    if (thr == current_thread) {
+        cpu += (cycles_t)(cycles_now() - thr->run_start);
+    } else if (thread_waiting(thr)) {
+        blocked += (cycles_t)(cycles_now() - thr->block_start);
+    }
+
+    out->tid = thr->id;
+    out->priority = thr->priority;
+    out->cpu_us = per_ms ? cpu * 1000 / per_ms : 0;
+    out->blocked_us = per_ms ? blocked * 1000 / per_ms : 0;
+    out->voluntary_switches = thr->voluntary_switches;
+    out->involuntary_switches = thr->involuntary_switches;
+    out->preemptions_skipped = thr->preemptions_skipped;
+    out->stack_used = stack_usage(thr);
+}
+
+int Thread_stats(int tid, Thread_stats_T *out) {
+    threadsafe_assert(out && "Thread_stats needs somewhere to store the statistics");
+    PREEMPT_DISABLE();
+
+    Thread *thr = Thread_find(tid);
+
+    if (thr) {
+        fill_stats(thr, out, cycles_per_ms());
+    }
+    PREEMPT_ENABLE();
+
+    return thr ? 0 : -1;
+}
+
+int Thread_stats_all(Thread_stats_T *out, int max) {
+    PREEMPT_DISABLE();
+    uint32_t per_ms = cycles_per_ms();
+    int n = 0;
+
+    for (int i = 0; i < table_size && n < max; i++) {
+        if (thread_table[i]->status != INVALID) {
+            fill_stats(thread_table[i], &out[n++], per_ms);
+        }
+    }
+    PREEMPT_ENABLE();
+
+    return n;
 }
 
 int Thread_self() {
     return current_thread->id;
 }
 
-void Thread_pause() {
-    uint32_t **curr_sp = &current_thread->sp;
+/* Give up the processor to the next ready thread of the same or higher priority, if any.
+ * voluntary tells whether the thread asked for it or is being preempted */
+static void yield_current(int voluntary) {
+    Thread *prev_thread = current_thread;
+
+    // Nothing else of the same or higher priority can run, keep running without touching the run queue
+    if (!ready_at_least(prev_thread->priority)) {
+        return;
+    }
+
+    make_runnable(prev_thread);
     current_thread = select_runnable_thread();
 
     // Runqueue should have at least one element, the thread that called Thread_pause itself
     threadsafe_assert(current_thread && "Something went REALLY wrong, contact the library developer");
 
-    _swtch(curr_sp, &current_thread->sp);
+    if (voluntary) {
+        ++prev_thread->voluntary_switches;
+    } else {
+        ++prev_thread->involuntary_switches;
+    }
+    account_switch(prev_thread, current_thread);
+
+    stack_check(prev_thread);
+    TRACE(TRACE_SWITCH, current_thread->id, prev_thread->id);
+    switch_to(prev_thread, current_thread);
+}
+
+/* Give up the processor if a ready thread has a higher priority than the current one.
+ * Called with preemption disabled once. Nested deeper, inside another library call that may
+ * still be walking its own lists, the switch is left to the outermost PREEMPT_ENABLE */
+static void yield_if_outranked() {
+    if (outranked(current_thread)) {
+        if (preempt_count > 1) {
+            preempt_pending = 1;
+        } else {
+            yield_current(0);
+        }
+    }
+}
+
+void Thread_pause() {
+    PREEMPT_DISABLE();
+    yield_current(1);
+    PREEMPT_ENABLE();
+}
+
+static void mutex_enqueue(Mutex_T *m, Thread *thr);
+
+/* Set the effective priority of thr, moving it to its place in the queue it is in */
+static void change_priority(Thread *thr, int priority) {
+    if (thr->status == RUNNING && thr != current_thread) {
+        // A ready thread moves to the end of the run queue of its new priority
+        remove_runnable(thr);
+        thr->priority = priority;
+        make_runnable(thr);
+    } else if (thr->status == WAIT_FOR_MUTEX) {
+        thread_remove(&thr->waiting_for_mutex->waiters, thr);
+        thr->priority = priority;
+        mutex_enqueue(thr->waiting_for_mutex, thr);
+    } else {
+        thr->priority = priority;
+        update_timer(current_thread);
+    }
+}
+
+/* Return the priority thr is entitled to: its own, or that of the first waiter of a
+ * priority inheriting mutex it holds, whichever is higher */
+static int inherited_priority(Thread *thr) {
+    int priority = thr->base_priority;
+
+    for (Mutex_T *m = thr->held_mutexes; m; m = m->next_held) {
+        if (!iqueue_isEmpty(&m->waiters)) {
+            Thread *waiter = IQUEUE_ENTRY(m->waiters.head, Thread, link);
+
+            if (waiter->priority > priority) {
+                priority = waiter->priority;
+            }
+        }
+    }
+
+    return priority;
+}
+
+/* Raise the owner of a priority inheriting mutex to priority, and so on down the chain
+ * of owners blocked on other such mutexes. Stops at the first owner already that high,
+ * which also ends the walk around a deadlock cycle */
+static void lend_priority(Thread *owner, int priority) {
+    while (owner && owner->priority < priority) {
+        Mutex_T *m = owner->status == WAIT_FOR_MUTEX ? owner->waiting_for_mutex : NULL;
+
+        change_priority(owner, priority);
+        if (!m || !(m->flags & MUTEX_PRIORITY_INHERIT)) {
+            break;
+        }
+        owner = m->owner;
+    }
+}
+
+int Thread_set_priority(int tid, int priority) {
+    threadsafe_assert(THREAD_PRIORITY_MIN <= priority && priority <= THREAD_PRIORITY_MAX &&
+                      "Runtime error: Invalid thread priority");
+    PREEMPT_DISABLE();
+
+    Thread *thr = Thread_find(tid);
+
+    if (!thr) {
+        PREEMPT_ENABLE();
+        return -1;
+    }
+
+    // Whatever priority thr lends from mutex waiters stays on top of the new one
+    thr->base_priority = priority;
+    change_priority(thr, inherited_priority(thr));
+    if (thr->status == WAIT_FOR_MUTEX && (thr->waiting_for_mutex->flags & MUTEX_PRIORITY_INHERIT)) {
+        lend_priority(thr->waiting_for_mutex->owner, thr->priority);
+    }
+
+    yield_if_outranked();
+    PREEMPT_ENABLE();
+
+    return 0;
+}
+
+void Thread_sleep_us(int usecs) {
+    if (usecs <= 0) {
+        Thread_pause();
+        return;
+    }
+
+    PREEMPT_DISABLE();
+    current_thread->status = SLEEPING;
+    start_timeout(usecs);
+    block_current();
+    PREEMPT_ENABLE();
 }
 
 int Thread_join(int tid) {
-    threadsafe_assert((tid || Thread_self() != tid) && "Runtime error: A non-zero tid cannot name the calling thread");
+    int code;
+
+    if (Thread_join_timeout(tid, -1, &code) < 0) {
+        return -1;
+    }
+
+    return code;
+}
+
+int Thread_join_timeout(int tid, int usecs, int *code) {
+    threadsafe_assert((!tid || Thread_self() != tid) && "Runtime error: A non-zero tid cannot name the calling thread");
+    PREEMPT_DISABLE();
+
+    Thread *target = NULL;
 
     // If tid doesn't exist, return -1
-    if (tid && !Thread_exists(tid)) {
+    if (tid && !(target = Thread_find(tid))) {
+        PREEMPT_ENABLE();
         return -1;
     }
 
-    // If tid is 0 and the only existing thread, return 0 immediately
+    // If tid is 0 and the only existing thread, return immediately
     if (!tid && existing_threads == 1) {
-        return 0;
+        if (code) {
+            *code = 0;
+        }
+        PREEMPT_ENABLE();
+        return 1;
     }
 
-    // If there is such a queue, insert the current queue in that. If tid == 0 and there is already a thread in that queue, raise error
-    // Otherwise create a new queue an the insert
+    // Insert the current thread in the joiner list of tid. If tid == 0 take the join(0) slot,
+    // which can only be held by a single thread
+    threadsafe_assert((tid || !zero_joiner) && "Runtime error: Only a single thread can call join(0)");
 
-    threadsafe_assert((tid || waiting_for_zero == 0) && "Runtime error: Only a single thread can call join(0)");
+    if (usecs == 0) {
+        PREEMPT_ENABLE();
+        return 0;
+    }
 
     current_thread->status = WAIT_AT_JOIN;
     current_thread->wait_for_ID = tid;
-    if (tid == 0) {
-        waiting_for_zero++;
+    if (target) {
+        thread_enqueue(&target->joiners, current_thread);
+    } else {
+        zero_joiner = current_thread;
     }
 
-    uint32_t **curr_sp = &current_thread->sp;
-
-    current_thread = select_runnable_thread();
-
-    threadsafe_assert(current_thread && "Deadlock detected: No threads in run queue");
-
-    _swtch(curr_sp, &current_thread->sp);
+    if (usecs > 0) {
+        start_timeout(usecs);
+    }
+    block_current();
+    PREEMPT_ENABLE();
 
-    return current_thread->returned_value;
+    if (current_thread->timed_out) {
+        return 0;
+    }
+    if (code) {
+        *code = current_thread->returned_value;
+    }
+    return 1;
 }
 
 void Sem_init(T *s, int count) {
     threadsafe_assert(s && "Semaphore cannot be NULL");
+    PREEMPT_DISABLE();
     s->count = count;
     s->id = get_new_sid();
+    iqueue_init(&s->waiters);
+    PREEMPT_ENABLE();
 }
 
 void Sem_wait(T *s) {
-    // While the semaphore's count isn't greater than 0, the current thread blocks
-    while (!(s->count > 0)) {
-        current_thread->status = WAIT_FOR_SEM;
-        current_thread->waiting_for_sem = s->id;
+    Sem_wait_timeout(s, -1);
+}
+
+int Sem_wait_timeout(T *s, int usecs) {
+    threadsafe_assert(s && "Semaphore cannot be NULL");
+    PREEMPT_DISABLE();
+    TRACE(TRACE_SEM_WAIT, current_thread->id, s->id);
 
-        uint32_t **curr_sp = &current_thread->sp;
-        current_thread = select_runnable_thread();
+    if (s->count > 0) {
+        --s->count;
+        PREEMPT_ENABLE();
+        return 1;
+    }
+    if (usecs == 0) {
+        PREEMPT_ENABLE();
+        return 0;
+    }
+
+    // Block at the end of the semaphore's wait queue. Sem_signal hands its count
+    // directly to the first waiter, so there is nothing left to do after waking up
+    current_thread->status = WAIT_FOR_SEM;
+    current_thread->waiting_for_sem = s;
+    thread_enqueue(&s->waiters, current_thread);
 
-        threadsafe_assert(current_thread && "Deadlock detected: No threads in run queue");
-        current_thread->status = RUNNING;
-        _swtch(curr_sp, &current_thread->sp);
+    if (usecs > 0) {
+        start_timeout(usecs);
     }
+    block_current();
+    PREEMPT_ENABLE();
 
-    --s->count;
+    return !current_thread->timed_out;
 }
 
 void Sem_signal(T *s) {
     threadsafe_assert(s && "Semaphore cannot be NULL");
-    ++s->count;
+    PREEMPT_DISABLE();
+    TRACE(TRACE_SEM_SIGNAL, current_thread->id, s->id);
+
+    // Wake up exactly one waiter, in the order they blocked, or raise the count if there are none
+    Thread *waiter = thread_dequeue(&s->waiters);
+
+    if (waiter) {
+        waiter->waiting_for_sem = NULL;
+        make_runnable(waiter);
+        yield_if_outranked();
+    } else {
+        ++s->count;
+    }
+    PREEMPT_ENABLE();
+}
+
+/* Insert thr in the wait queue of m after the waiters of the same or higher priority */
+static void mutex_enqueue(Mutex_T *m, Thread *thr) {
+    IQueue_link *prev = NULL;
+
+    for (IQueue_link *l = m->waiters.head; l && IQUEUE_ENTRY(l, Thread, link)->priority >= thr->priority;
+         l = l->next) {
+        prev = l;
+    }
+    iqueue_insert_after(&m->waiters, prev, &thr->link);
+}
+
+/* Make thr the owner of m */
+static void mutex_take(Mutex_T *m, Thread *thr) {
+    m->owner = thr;
+    if (m->flags & MUTEX_PRIORITY_INHERIT) {
+        m->next_held = thr->held_mutexes;
+        thr->held_mutexes = m;
+    }
+}
+
+void Mutex_init(Mutex_T *m, int flags) {
+    threadsafe_assert(m && "Mutex cannot be NULL");
+    m->owner = NULL;
+    m->flags = flags;
+    m->next_held = NULL;
+    iqueue_init(&m->waiters);
+}
 
-    // Put all threads wait'ing on the semaphore back in the run queue
-    for (int i = 0; i < MAX_THREADS; i++) {
-        if ((thread_table[i].status == WAIT_FOR_SEM) && (s->id == thread_table[i].waiting_for_sem)) {
-            thread_table[i].status = RUNNING;
+void Mutex_lock(Mutex_T *m) {
+    threadsafe_assert(m && m->owner != current_thread && "Runtime error: Mutex already held by the calling thread");
+    PREEMPT_DISABLE();
+
+    if (!m->owner) {
+        mutex_take(m, current_thread);
+        PREEMPT_ENABLE();
+        return;
+    }
+
+    // Block in priority order. Mutex_unlock hands the mutex directly to the first waiter,
+    // so it is ours once we wake up
+    current_thread->status = WAIT_FOR_MUTEX;
+    current_thread->waiting_for_mutex = m;
+    mutex_enqueue(m, current_thread);
+
+    if (m->flags & MUTEX_PRIORITY_INHERIT) {
+        lend_priority(m->owner, current_thread->priority);
+    }
+    block_current();
+    PREEMPT_ENABLE();
+}
+
+int Mutex_trylock(Mutex_T *m) {
+    int taken = 0;
+
+    threadsafe_assert(m && "Mutex cannot be NULL");
+    PREEMPT_DISABLE();
+    if (!m->owner) {
+        mutex_take(m, current_thread);
+        taken = 1;
+    }
+    PREEMPT_ENABLE();
+
+    return taken;
+}
+
+/* Give up m, held by the current thread, without yielding to whoever it goes to */
+static void mutex_release(Mutex_T *m) {
+    if (m->flags & MUTEX_PRIORITY_INHERIT) {
+        Mutex_T **pp = &current_thread->held_mutexes;
+
+        while (*pp != m) {
+            pp = &(*pp)->next_held;
         }
+        *pp = m->next_held;
+    }
+
+    // Hand the mutex to exactly one waiter, the first one in priority order, or leave it unlocked.
+    // The new owner outranks the waiters left, so it has nothing to inherit from them
+    Thread *waiter = thread_dequeue(&m->waiters);
+
+    m->owner = NULL;
+    if (waiter) {
+        waiter->waiting_for_mutex = NULL;
+        mutex_take(m, waiter);
+        make_runnable(waiter);
     }
+
+    // Give back what was lent through m
+    if (current_thread->priority != current_thread->base_priority) {
+        change_priority(current_thread, inherited_priority(current_thread));
+    }
+}
+
+void Mutex_unlock(Mutex_T *m) {
+    threadsafe_assert(m && m->owner == current_thread && "Runtime error: Mutex unlocked by a thread that doesn't hold it");
+    PREEMPT_DISABLE();
+    mutex_release(m);
+
+    yield_if_outranked();
+    PREEMPT_ENABLE();
+}
+
+void Cond_init(Cond_T *c) {
+    threadsafe_assert(c && "Condition variable cannot be NULL");
+    iqueue_init(&c->waiters);
+}
+
+void Cond_wait(Cond_T *c, Mutex_T *m) {
+    threadsafe_assert(c && m && m->owner == current_thread && "Runtime error: Cond_wait without holding the mutex");
+    PREEMPT_DISABLE();
+
+    // Releasing m and joining the wait queue happen with preemption disabled, so no signal
+    // can slip in between. A signal hands us m before we run again
+    current_thread->status = WAIT_FOR_COND;
+    current_thread->waiting_for_mutex = m;
+    thread_enqueue(&c->waiters, current_thread);
+
+    mutex_release(m);
+    block_current();
+    PREEMPT_ENABLE();
+}
+
+/* Let a thread taken off a condition variable's queue go on to its mutex. It takes the mutex
+ * if it is free, otherwise it moves to the mutex's wait queue without waking up */
+static void cond_wake(Thread *waiter) {
+    Mutex_T *m = waiter->waiting_for_mutex;
+
+    if (!m->owner) {
+        waiter->waiting_for_mutex = NULL;
+        mutex_take(m, waiter);
+        make_runnable(waiter);
+        return;
+    }
+
+    waiter->status = WAIT_FOR_MUTEX;
+    mutex_enqueue(m, waiter);
+    if (m->flags & MUTEX_PRIORITY_INHERIT) {
+        lend_priority(m->owner, waiter->priority);
+    }
+}
+
+void Cond_signal(Cond_T *c) {
+    threadsafe_assert(c && "Condition variable cannot be NULL");
+    PREEMPT_DISABLE();
+
+    // Wake exactly one waiter, in the order they blocked
+    Thread *waiter = thread_dequeue(&c->waiters);
+
+    if (waiter) {
+        cond_wake(waiter);
+        yield_if_outranked();
+    }
+    PREEMPT_ENABLE();
+}
+
+void Cond_broadcast(Cond_T *c) {
+    Thread *waiter;
+
+    threadsafe_assert(c && "Condition variable cannot be NULL");
+    PREEMPT_DISABLE();
+
+    // Only the first waiter can get the mutex, the others queue up behind it
+    while ((waiter = thread_dequeue(&c->waiters))) {
+        cond_wake(waiter);
+    }
+
+    yield_if_outranked();
+    PREEMPT_ENABLE();
+}
+
+void RWLock_init(RWLock_T *l, int flags) {
+    threadsafe_assert(l && "Reader-writer lock cannot be NULL");
+    l->readers = 0;
+    l->writer = NULL;
+    l->flags = flags;
+    iqueue_init(&l->read_waiters);
+    iqueue_init(&l->write_waiters);
+}
+
+/* Return 1 if a new reader may take l shared right away */
+static int rwlock_readable(RWLock_T *l) {
+    return !l->writer && !((l->flags & RWLOCK_PREFER_WRITER) && !iqueue_isEmpty(&l->write_waiters));
+}
+
+void RWLock_rdlock(RWLock_T *l) {
+    threadsafe_assert(l && "Reader-writer lock cannot be NULL");
+    PREEMPT_DISABLE();
+
+    if (rwlock_readable(l)) {
+        ++l->readers;
+        PREEMPT_ENABLE();
+        return;
+    }
+
+    // The thread that lets us in counts us as a reader before we wake up
+    current_thread->status = WAIT_FOR_RWLOCK;
+    thread_enqueue(&l->read_waiters, current_thread);
+    block_current();
+    PREEMPT_ENABLE();
+}
+
+void RWLock_wrlock(RWLock_T *l) {
+    threadsafe_assert(l && l->writer != current_thread && "Runtime error: Lock already held by the calling thread");
+    PREEMPT_DISABLE();
+
+    if (!l->writer && !l->readers) {
+        l->writer = current_thread;
+        PREEMPT_ENABLE();
+        return;
+    }
+
+    // The thread that releases the lock hands it to us, so it is ours once we wake up
+    current_thread->status = WAIT_FOR_RWLOCK;
+    thread_enqueue(&l->write_waiters, current_thread);
+    block_current();
+    PREEMPT_ENABLE();
+}
+
+int RWLock_tryrdlock(RWLock_T *l) {
+    int taken = 0;
+
+    threadsafe_assert(l && "Reader-writer lock cannot be NULL");
+    PREEMPT_DISABLE();
+    if (rwlock_readable(l)) {
+        ++l->readers;
+        taken = 1;
+    }
+    PREEMPT_ENABLE();
+
+    return taken;
+}
+
+int RWLock_trywrlock(RWLock_T *l) {
+    int taken = 0;
+
+    threadsafe_assert(l && "Reader-writer lock cannot be NULL");
+    PREEMPT_DISABLE();
+    if (!l->writer && !l->readers) {
+        l->writer = current_thread;
+        taken = 1;
+    }
+    PREEMPT_ENABLE();
+
+    return taken;
+}
+
+/* Hand the free lock l to the first waiting writer */
+static void rwlock_grant_writer(RWLock_T *l) {
+    Thread *waiter = thread_dequeue(&l->write_waiters);
+
+    l->writer = waiter;
+    make_runnable(waiter);
+}
+
+/* Let every waiting reader in at once. They are all made ready before anyone runs, so
+ * they share the lock instead of waking one another in turn */
+static void rwlock_grant_readers(RWLock_T *l) {
+    Thread *waiter;
+
+    while ((waiter = thread_dequeue(&l->read_waiters))) {
+        ++l->readers;
+        make_runnable(waiter);
+    }
+}
+
+void RWLock_unlock(RWLock_T *l) {
+    threadsafe_assert(l && (l->writer == current_thread || (!l->writer && l->readers > 0)) &&
+                      "Runtime error: Lock released by a thread that doesn't hold it");
+    PREEMPT_DISABLE();
+
+    if (l->writer) {
+        l->writer = NULL;
+
+        // Writers go first only if they are preferred, otherwise the readers that piled up
+        // behind this writer get their turn
+        if ((l->flags & RWLOCK_PREFER_WRITER) && !iqueue_isEmpty(&l->write_waiters)) {
+            rwlock_grant_writer(l);
+        } else if (!iqueue_isEmpty(&l->read_waiters)) {
+            rwlock_grant_readers(l);
+        } else if (!iqueue_isEmpty(&l->write_waiters)) {
+            rwlock_grant_writer(l);
+        }
+    } else if (--l->readers == 0 && !iqueue_isEmpty(&l->write_waiters)) {
+        rwlock_grant_writer(l);
+    }
+
+    yield_if_outranked();
+    PREEMPT_ENABLE();
 }
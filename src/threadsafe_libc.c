@@ -3,62 +3,73 @@
 #include <stdlib.h>
 #include <string.h>
 
-int in_libc_flag = 0;
+// Included last, after the libc declarations it would otherwise rename. The wrappers call the real functions
+#include "threadsafe_libc.h"
+#undef free
+#undef malloc
+#undef calloc
+#undef memset
+#undef memcpy
+#undef printf
+#undef exit
+
+volatile int preempt_count = 0;
+volatile int preempt_pending = 0;
 
 void threadsafe_free(void *ptr) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     free(ptr);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 }
 
 void *threadsafe_malloc(size_t __size) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     void *ptr = malloc(__size);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 
     return ptr;
 }
 
 void *threadsafe_calloc(size_t __nmemb, size_t __size) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     void *ptr = calloc(__nmemb, __size);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 
     return ptr;
 }
 
 void *threadsafe_memset(void *__s, int __c, size_t __n) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     void *ptr = memset(__s, __c, __n);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 
     return ptr;
 }
 
 void *threadsafe_memcpy(void *__restrict__ __dest, const void *__restrict__ __src, size_t __n) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     void *ptr = memcpy(__dest, __src, __n);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 
     return ptr;
 }
 
 void threadsafe_exit(int __status) {
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
     exit(__status);
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
 }
 
 int threadsafe_printf(const char *__restrict__ __format, ...) {
     int ret_val;
     va_list args;
 
-    in_libc_flag = 1;
+    PREEMPT_DISABLE();
 
     va_start(args, __format);
     ret_val = vprintf(__format, args);
     va_end(args);
 
-    in_libc_flag = 0;
+    PREEMPT_ENABLE();
     return ret_val;
 }
\ No newline at end of file
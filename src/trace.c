@@ -0,0 +1,62 @@
+#include "trace.h"
+#include "cycles.h"
+#include "threadsafe_libc.h"
+
+#if THREAD_TRACE
+#define TRACE_MASK (TRACE_SIZE - 1)
+
+static Trace_record trace_buf[TRACE_SIZE];
+static uint32_t trace_next; // records ever written, the next one goes to trace_buf[trace_next & TRACE_MASK]
+static int trace_enabled;
+
+void Trace_init(void) {
+    trace_next = 0;
+    trace_enabled = 1;
+}
+
+void Trace_enable(int on) {
+    trace_enabled = on;
+}
+
+void trace_record(Trace_event type, int tid, uint32_t arg) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    Trace_record *r = &trace_buf[trace_next++ & TRACE_MASK];
+
+    r->cycles = (uint32_t)cycles_now();
+    r->type = (uint8_t)type;
+    r->tid = tid;
+    r->arg = arg;
+}
+
+void Trace_dump(void write(const void *data, size_t size, void *cl), void *cl) {
+    int was_enabled = trace_enabled;
+    Trace_header header;
+
+    // write may block and let other threads run, which must not overwrite the records being written
+    trace_enabled = 0;
+
+    uint32_t count = trace_next < TRACE_SIZE ? trace_next : TRACE_SIZE;
+    uint32_t first = trace_next - count;
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(Trace_record);
+    header.count = count;
+    header.cycles_per_ms = cycles_per_ms();
+    write(&header, sizeof header, cl);
+
+    // The records are written in at most two runs, around the end of the ring
+    uint32_t start = first & TRACE_MASK;
+    uint32_t run = count < TRACE_SIZE - start ? count : TRACE_SIZE - start;
+
+    write(&trace_buf[start], run * sizeof(Trace_record), cl);
+    if (run < count) {
+        write(&trace_buf[0], (count - run) * sizeof(Trace_record), cl);
+    }
+
+    trace_enabled = was_enabled;
+}
+#endif
@@ -0,0 +1,137 @@
+/* Convert a dump written by Trace_dump into Chrome trace event JSON,
+ * which chrome://tracing and ui.perfetto.dev can open.
+ * usage: trace2json [-m MHz] [dump] > trace.json
+ * -m overrides the cycle counter frequency recorded in the dump.
+ * Every thread gets a track with a "running" slice for each time it was scheduled
+ * and instant events for everything else it did */
+
+#include "trace.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *event_names[TRACE_NUM_EVENTS] = {
+    "switch", "block", "wakeup", "sem_wait", "sem_signal", "chan_send", "chan_receive", "create", "exit",
+};
+
+static const char *block_reasons[] = {"?", "join", "sem", "sleep", "mutex", "cond", "rwlock"};
+
+static double cycles_per_us;
+static int first_event = 1;
+
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void emit(const char *fmt, ...) {
+    va_list ap;
+
+    printf(first_event ? "\n" : ",\n");
+    first_event = 0;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static double to_us(unsigned long long cycles) {
+    return cycles / cycles_per_us;
+}
+
+int main(int argc, char *argv[]) {
+    double mhz = 0;
+    FILE *in = stdin;
+    Trace_header header;
+    Trace_record r;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mhz = atof(argv[++i]);
+        } else if (!(in = fopen(argv[i], "rb"))) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+
+    if (fread(&header, sizeof header, 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0) {
+        fprintf(stderr, "trace2json: not a trace dump\n");
+        return 1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(Trace_record)) {
+        fprintf(stderr, "trace2json: unsupported dump version %u\n", header.version);
+        return 1;
+    }
+    cycles_per_us = mhz > 0 ? mhz : header.cycles_per_ms / 1000.0;
+    if (cycles_per_us <= 0) {
+        fprintf(stderr, "trace2json: unknown cycle counter frequency, use -m\n");
+        return 1;
+    }
+
+    // The 32 bit timestamps wrap around. Events are in order, so each one is after the previous one
+    unsigned long long now = 0;
+    uint32_t last_cycles = 0;
+    int running = 0; // thread whose running slice is open, 0 before the first switch
+    unsigned long long run_start = 0;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (uint32_t n = 0; n < header.count && fread(&r, sizeof r, 1, in) == 1; n++) {
+        if (n > 0) {
+            now += (uint32_t)(r.cycles - last_cycles);
+        }
+        last_cycles = r.cycles;
+
+        if (r.type >= TRACE_NUM_EVENTS) {
+            continue;
+        }
+
+        if (r.type == TRACE_SWITCH) {
+            // Until the first switch we don't know who was running, assume it ran since the start of the dump
+            if (!running) {
+                running = (int)r.arg;
+            }
+            emit("{\"name\":\"running\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", running,
+                 to_us(run_start), to_us(now - run_start));
+            running = r.tid;
+            run_start = now;
+            continue;
+        }
+
+        if (r.type == TRACE_CREATE) {
+            emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                 r.tid, r.tid);
+        }
+
+        const char *name = event_names[r.type];
+        char arg[64];
+
+        switch (r.type) {
+        case TRACE_BLOCK:
+            snprintf(arg, sizeof arg, "\"reason\":\"%s\"", block_reasons[r.arg < sizeof block_reasons / sizeof *block_reasons ? r.arg : 0]);
+            break;
+        case TRACE_WAKEUP:
+        case TRACE_CREATE:
+            snprintf(arg, sizeof arg, "\"by\":%d", (int)r.arg);
+            break;
+        case TRACE_SEM_WAIT:
+        case TRACE_SEM_SIGNAL:
+            snprintf(arg, sizeof arg, "\"sem\":%u", r.arg);
+            break;
+        case TRACE_CHAN_SEND:
+        case TRACE_CHAN_RECEIVE:
+            snprintf(arg, sizeof arg, "\"chan\":%u", r.arg);
+            break;
+        default:
+            snprintf(arg, sizeof arg, "\"code\":%d", (int)r.arg);
+            break;
+        }
+        emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{%s}}", name, r.tid,
+             to_us(now), arg);
+    }
+
+    if (running) {
+        emit("{\"name\":\"running\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", running,
+             to_us(run_start), to_us(now - run_start));
+    }
+    printf("\n]}\n");
+
+    return 0;
+}